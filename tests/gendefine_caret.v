@@ -0,0 +1,5 @@
+// ^ is a power in a GENDEFINE range: 0 to 255, and 0 to 1. As xor, 2^8-256 would be negative.
+//%%GENDEFINE%% (always_list, 0, 2^8-1)
+//%%GENDEFINE%% (always_list, 2^8-256, 1)
+module top(input wire clk);
+endmodule
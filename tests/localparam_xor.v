@@ -0,0 +1,5 @@
+module top(input wire clk, output wire [7:0] out);
+	localparam IDX = 2;
+	reg [7:0] mem [0:3];
+	assign out = mem[IDX ^ 1] + mem[2 ** 1];
+endmodule
@@ -14,29 +14,158 @@
 
 #include <iostream>
 #include <sstream>
+#include <iomanip>
 #include <memory>
 #include <unordered_map>
 #include <vector>
 #include <cstring>
 #include <cctype>
 #include <deque>
+#include <set>
 #include <stack>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <stdexcept>
+#include <iterator>
+#include <tuple>
+#include <cstdint>
+#include <limits>
 #include <math.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include <dirent.h>
 
 using namespace std;
 
+/**
+ * Thrown for anything wrong with the input. It stops the processing of the file
+ * it was found in, but in batch mode the other files carry on.
+ */
+class PreprocessorError : public std::runtime_error {
+public:
+	PreprocessorError(const string& what) : std::runtime_error(what) { }
+};
+
+enum class GendefineType : size_t {
+	NONE = 0,
+	CHOOSE_TO,
+	CHOOSE_FROM,
+	ALWAYS_LIST,
+	MOD_OP,
+};
+
+namespace std {
+	template<>
+	struct hash<GendefineType> {
+		size_t operator()(const GendefineType& gt) const {
+			return std::hash<size_t>()(static_cast<size_t>(gt));
+		}
+	};
+}
+
+/**
+ * What a %%GENDEFINE%% asks for. The case arms (or list) aren't stored anywhere;
+ * they're written straight out each time the macro is used, as the ranges can be
+ * very large.
+ */
+struct GendefineSpec {
+	GendefineType type;
+	string assignment_op;
+	size_t range_first;
+	size_t range_last;
+	size_t mod_by;
+
+	void write(const vector<string>& args, ostream& os) const;
+};
+
+/**
+ * A `define'd macro. The body is split up front into literal text and the places
+ * where parameters go (whole identifiers only), so expanding it is just appending
+ * the pieces in order.
+ */
 class Macro {
 public:
 	Macro(istream& is);
 	Macro(string name, const vector<string>& params, string body);
-	string getName() { return name; }
-	string expand(const vector<string>& args);
-	bool isEmptyMacro() { return body.size() == 0; }
+	Macro(string name, const vector<string>& params, const GendefineSpec& gendefine);
+	string getName() const { return name; }
+	const string& getBody() const { return body; }
+	void expand(const vector<string>& args, ostream& os) const;
+	bool isEmptyMacro() { return body.size() == 0 && gendefine.type == GendefineType::NONE; }
+	size_t getNumParams() const { return params.size(); }
+	/// whether the body uses other macros, so that the expansion needs to be expanded too
+	bool hasMacroUses() const { return has_macro_uses; }
 private:
+	void compile();
+	struct Segment {
+		string literal;
+		size_t param_index; // of the param that goes after literal, if any
+	};
+	static const size_t no_param = static_cast<size_t>(-1);
+
 	bool is_function_like;
 	vector<string> params;
 	string body;
 	string name;
+	vector<Segment> segments;
+	bool has_macro_uses;
+	GendefineSpec gendefine; // type is NONE for ordinary macros
+};
+
+/**
+ * What ^ means to a ConstantEvaluator: xor, as in Verilog, or a power (like **), as
+ * GENDEFINE ranges have always had it.
+ */
+enum class Caret {
+	XOR,
+	POWER,
+};
+
+/**
+ * Works out the value of constant expressions: numbers (sized and based ones too),
+ * symbols it's been told about, + - * / % ** ^ and parentheses. An expression is
+ * tokenized once and the result (or that it wasn't constant) is remembered by its
+ * text, as the same indices come up over and over again.
+ */
+class ConstantEvaluator {
+public:
+	ConstantEvaluator(Caret caret);
+	/// returns false, leaving result alone, if expr isn't constant (eg. it uses a variable)
+	bool evaluate(const string& expr, long& result);
+	void defineSymbol(const string& name, long value);
+	/// takes what follows `localparam', and defines the constant ones
+	void defineParameters(const string& decl);
+	void clearSymbols();
+private:
+	struct Token {
+		char kind; // 'n' for a number, 'p' for **, otherwise the operator or parenthesis
+		long value;
+	};
+	bool tokenize(const string& expr);
+	bool parseNumber(const string& expr, size_t& pos, long& value);
+	bool parseExpression(int min_precedence, long& result);
+	bool parsePrimary(long& result);
+
+	Caret caret;
+	unordered_map<string,long> symbols;
+	unordered_map<string,std::pair<bool,long>> memo;
+	vector<Token> tokens;
+	size_t next_token;
+	ConstantEvaluator(const ConstantEvaluator&) = delete;
+	ConstantEvaluator& operator=(const ConstantEvaluator&) = delete;
 };
 
 class WireInfo {
@@ -57,8 +186,11 @@ public:
 		, custom_firstdim_decl()
 		, dimension_sizes() { }
 	string makeDeclaration();
-	static std::pair<bool,WireInfo> parseWire(string&);
+	/// declares just these elements of a twodim (the ones in range, anyway)
+	string makeDeclaration(const std::set<size_t>& indices);
+	static std::pair<bool,WireInfo> parseWire(string&, ConstantEvaluator& constants);
 private:
+	string makeOnedimBase();
 	string name;
 	string type;
 	bool use_custom_firstdim_decl;
@@ -66,10 +198,374 @@ private:
 	vector<std::pair<size_t,size_t>> dimension_sizes;
 };
 
-void macro_expansion_pass(istream& is, ostream& os, const vector<string>& predef_macros);
-void module_redeclaration_pass(istream& is, ostream& os);
-void twodim_reduction_pass(istream& is, ostream& os);
-void final_touches_pass(istream& is, ostream& os);
+/**
+ * Reads a whole file descriptor. Regular files are mapped into memory, anything
+ * else (a pipe on stdin, say) is read a large block at a time.
+ */
+class FileDescriptorInBuf : public streambuf {
+public:
+	FileDescriptorInBuf(int fd, bool owns_fd = false);
+	~FileDescriptorInBuf();
+protected:
+	int_type underflow() override;
+private:
+	int fd;
+	bool owns_fd;
+	char* mapped_data;
+	size_t mapped_size;
+	vector<char> buffer;
+	FileDescriptorInBuf(const FileDescriptorInBuf&) = delete;
+	FileDescriptorInBuf& operator=(const FileDescriptorInBuf&) = delete;
+};
+
+/**
+ * Finds `include'd files, and keeps what each header preprocesses to on its own, so
+ * that a header shared by many files is only parsed once. A header whose result
+ * would depend on where it's included from (it tests or uses a macro it doesn't
+ * define, say) is marked as such, and gets expanded in place every time instead.
+ * Holds the predefined macros and include paths too, as the cached results depend
+ * on them. Safe to share between threads.
+ */
+class HeaderCache {
+public:
+	struct ParsedHeader {
+		ParsedHeader() : context_independent(true), text(), macros(), included_files(), missing_files() { }
+		bool context_independent;
+		string text;
+		vector<Macro> macros;
+		vector<string> included_files;
+		vector<string> missing_files;
+	};
+	HeaderCache(const vector<string>& predef_macros, const vector<string>& include_paths);
+	const vector<string>& getPredefMacros() { return predef_macros; }
+	/**
+	 * Returns the canonical path of the file, or "" if it can't be found. Adds the
+	 * places looked in first, where it wasn't, to missing_files.
+	 */
+	string resolve(const string& file_name, const string& including_dir, vector<string>& missing_files);
+	shared_ptr<const ParsedHeader> get(const string& path, size_t include_depth);
+private:
+	vector<string> predef_macros;
+	vector<string> include_paths;
+	std::mutex path2header_mutex;
+	unordered_map<string,shared_ptr<const ParsedHeader>> path2header;
+	HeaderCache(const HeaderCache&) = delete;
+	HeaderCache& operator=(const HeaderCache&) = delete;
+};
+
+/**
+ * How to process each file; from the command line.
+ */
+struct PipelineOptions {
+	PipelineOptions() : streaming(false), print_stats(false), declare_used_only(false) { }
+	bool streaming;
+	bool print_stats;
+	bool declare_used_only; // declare only the elements of twodims that are used
+};
+
+/**
+ * An on-disk cache of preprocessed output, so that unchanged files aren't processed
+ * again. A key covers the input, the predefined macros, the include paths, the
+ * options that change the output, and this build of the program. <key>.deps lists
+ * the files that the input `include'd, with their hashes, and the places that were
+ * looked in for them first, which have to stay empty. The output is stored under a
+ * second key that covers those too.
+ * Everything is renamed into place, so concurrent runs can share a cache, and the
+ * least recently used files are evicted once it's bigger than max_size.
+ * Outputs are copied in and out of the cache (reflinked where the file system can),
+ * never linked, so writing to an output can't change the cached copy. Cached files
+ * are read-only as well.
+ */
+class OutputCache {
+public:
+	OutputCache(
+		const string& dir, uint64_t max_size, const vector<string>& predef_macros,
+		const vector<string>& include_paths, const PipelineOptions& options);
+	string makeKey(const string& input_hash, const string& input_dir);
+	/// returns the path of the cached output, or "" if there isn't an up to date one
+	string lookup(const string& key);
+	void store(
+		const string& key, const vector<string>& included_files, const vector<string>& missing_files,
+		const string& output_path);
+	void storeText(
+		const string& key, const vector<string>& included_files, const vector<string>& missing_files,
+		const string& output);
+	void evict();
+	void printStats(ostream& os);
+	static string hashBytes(const char* data, size_t size);
+	/// returns "" if the file can't be read
+	static string hashFile(const string& path);
+private:
+	string prepareEntry(
+		const string& key, const vector<string>& included_files, const vector<string>& missing_files,
+		string& deps);
+	void commitEntry(const string& key, const string& deps);
+	string makeTemporaryPath();
+	string dir;
+	uint64_t max_size;
+	string base_key;
+	std::atomic<size_t> num_hits;
+	std::atomic<size_t> num_misses;
+	std::atomic<size_t> num_stores;
+	std::atomic<size_t> num_evicted;
+	std::atomic<size_t> next_temporary_id;
+	OutputCache(const OutputCache&) = delete;
+	OutputCache& operator=(const OutputCache&) = delete;
+};
+
+/**
+ * What --stats reports about one pass. The counters a pass doesn't have stay at 0.
+ */
+struct PassStats {
+	double wall_ms;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t peak_buffer_bytes; // of its output, waiting for the next pass
+	uint64_t macro_expansions;
+	uint64_t gendefines_generated;
+	uint64_t twodims_found;
+	uint64_t indices_rewritten;
+};
+
+struct PipelineStats {
+	PipelineStats() : streaming(false), from_cache(false), passes() { }
+	bool streaming;
+	bool from_cache;
+	PassStats passes[4];
+	/// as one line of JSON
+	void print(ostream& os, const string& file_name) const;
+};
+
+/**
+ * What the passes need to know about the file being processed, and what they find
+ * out about it along the way.
+ */
+struct SourceFile {
+	SourceFile(const string& dir_) : dir(dir_), included_files(), missing_files(), stats(nullptr) { }
+	string dir;
+	// filled in by the macro expansion pass
+	vector<string> included_files;
+	vector<string> missing_files; // where an `include'd file was looked for first
+	PipelineStats* stats; // filled in by the pipeline, if not null
+};
+
+/**
+ * The output of the macro expansion pass is lexed once, as it's written, and the
+ * passes after it work on the tokens. A word is a run of identifier characters
+ * (so numbers are words too); comments and string literals are read by
+ * readCommentOrString; every other character is a token of its own. A
+ * placeholder isn't text, but somewhere a pass will put something later.
+ */
+enum class TokenKind {
+	WORD,
+	SPACE,
+	COMMENT,
+	STRING,
+	PUNCT,
+	PLACEHOLDER,
+};
+
+typedef uint32_t Symbol;
+
+const Symbol no_symbol = static_cast<Symbol>(-1);
+
+/// the words the passes look for. The lexer picks these out; other words have no symbol.
+enum class Keyword : Symbol {
+	MODULE,
+	ENDMODULE,
+	REG,
+	WIRE,
+	PARAMETER,
+	LOCALPARAM,
+	SIGNED,
+	INPUT,
+	OUTPUT,
+};
+
+Symbol findKeyword(const char* text, size_t size);
+
+/**
+ * A token, as a pass sees it: a span of the text of the chunk it's in. A keyword's
+ * symbol says which one it is, and any other word's is no_symbol. A placeholder has
+ * no text, and its number in symbol.
+ */
+struct Token {
+	const char* text;
+	size_t size;
+	TokenKind kind;
+	Symbol symbol;
+
+	bool is(char c) const { return kind == TokenKind::PUNCT && text[0] == c; }
+	bool is(Keyword keyword) const {
+		return kind == TokenKind::WORD && symbol == static_cast<Symbol>(keyword);
+	}
+	string str() const { return string(text, size); }
+	/// the character that the next token comes after, as the passes see it
+	int lastChar(int prev_char) const {
+		switch (kind) {
+			case TokenKind::COMMENT:     return ' ';
+			case TokenKind::STRING:      return '"';
+			case TokenKind::PLACEHOLDER: return prev_char;
+			default:                     return text[size - 1];
+		}
+	}
+};
+
+/**
+ * A run of tokens; what goes between passes. The text is kept as it is, and each
+ * token adds a code, usually of one byte, saying what it is and how much of the text
+ * it covers. Nothing outlives the chunk, so memory use doesn't depend on how many
+ * different words there are.
+ */
+struct TokenChunk {
+	TokenChunk() : text(), codes(), last_code(0) { }
+	TokenChunk(TokenChunk&&) = default;
+	TokenChunk& operator=(TokenChunk&&) = default;
+	void append(const Token& token);
+	/// adds the text of token (a word or space, like the last one) onto the last token
+	void extendLast(const Token& token);
+	/// the token at code_pos and text_pos, which are then moved past it
+	void decode(size_t& code_pos, size_t& text_pos, Token& token) const;
+	/// for a lexer that has put the text in already
+	void appendCode(const Token& token);
+	uint64_t getNumBytes() const { return text.size(); }
+	vector<char> text;
+	vector<unsigned char> codes;
+	size_t last_code; // where the last token's code starts
+};
+
+/**
+ * Words to look up by their text, such as the twodims the twodim reduction pass
+ * has found. Each gets the next symbol, starting from 0.
+ */
+class SymbolTable {
+public:
+	SymbolTable();
+	/// the word's symbol, or no_symbol if it isn't in here
+	Symbol find(const char* text, size_t size) const;
+	Symbol intern(const string& word);
+	size_t size() const { return num_symbols; }
+private:
+	struct Slot {
+		uint64_t hash;
+		size_t name; // in names, or no_name for an empty slot
+		size_t size;
+		Symbol symbol;
+	};
+	static const size_t no_name;
+	static uint64_t hashWord(const char* text, size_t size);
+	vector<Slot> slots; // open addressing, never more than half full
+	size_t num_symbols;
+	string names;
+	SymbolTable(const SymbolTable&) = delete;
+	SymbolTable& operator=(const SymbolTable&) = delete;
+};
+
+/// where a pass's tokens go. close() marks the end of them.
+class TokenSink {
+public:
+	virtual ~TokenSink() { }
+	virtual void push(TokenChunk&& chunk) = 0;
+	virtual void close() = 0;
+};
+
+/// where a pass's tokens come from. pop() returns false once there aren't any more.
+class TokenSource {
+public:
+	virtual ~TokenSource() { }
+	virtual bool pop(TokenChunk& chunk) = 0;
+};
+
+/**
+ * Somewhere to keep tokens until a pass has seen all of its input: pushed to until
+ * close(), and popped from after that.
+ */
+class TokenStore : public TokenSink, public TokenSource {
+public:
+	/// of text, pushed so far
+	virtual uint64_t getNumBytes() const = 0;
+};
+
+/**
+ * Reads tokens from a TokenSource one at a time, looking as far ahead as needed.
+ * What get() and peek() return is good until the next get(). A chunk is let go of
+ * once the last token in it has been passed.
+ */
+class TokenReader {
+public:
+	TokenReader(TokenSource& source);
+	~TokenReader();
+	/// the token that many after the next one, or null if the input ends first
+	const Token* peek(size_t ahead = 0);
+	/// the next token. There has to be one; see peek().
+	const Token& get();
+	uint64_t getNumBytesRead() const { return num_bytes_read; }
+private:
+	struct DecodedToken {
+		Token token;
+		uint64_t chunk_number;
+	};
+	bool decodeNext();
+	TokenSource& source;
+	deque<TokenChunk> chunks;
+	uint64_t first_chunk_number; // of chunks.front()
+	size_t decode_chunk; // in chunks
+	size_t code_pos;
+	size_t text_pos;
+	deque<DecodedToken> decoded; // peeked at, but not got yet
+	Token current;
+	bool source_done;
+	uint64_t num_bytes_read;
+	TokenReader(const TokenReader&) = delete;
+	TokenReader& operator=(const TokenReader&) = delete;
+};
+
+/**
+ * Collects tokens into chunks for a TokenSink. Text that a pass makes up is lexed as
+ * it's written. Adjacent words, and adjacent runs of whitespace, are joined into
+ * one token, so that what a pass glues together (like mem and _1) or takes apart
+ * comes out as if it had been lexed that way.
+ */
+class TokenWriter {
+public:
+	TokenWriter(TokenSink& sink);
+	void put(const Token& token);
+	/// each of the tokens in turn
+	void put(const TokenChunk& tokens);
+	void write(const string& text);
+	void putPlaceholder(Symbol number);
+	/// pushes what's left, and closes the sink
+	void close();
+	uint64_t getNumBytesWritten() const { return num_bytes_written; }
+private:
+	TokenSink& sink;
+	TokenChunk chunk;
+	TokenKind last_kind; // in chunk, if it isn't empty
+	uint64_t num_bytes_written;
+	TokenWriter(const TokenWriter&) = delete;
+	TokenWriter& operator=(const TokenWriter&) = delete;
+};
+
+void macro_expansion_pass(istream& is, ostream& os, HeaderCache& headers, SourceFile& source, PassStats& stats);
+void module_redeclaration_pass(TokenReader& in, TokenWriter& out);
+void twodim_reduction_pass(
+	TokenReader& in, TokenWriter& out, TokenStore& scratch, TokenStore* rewritten_scratch, PassStats& stats);
+void final_touches_pass(TokenReader& in, ostream& os);
+
+void run_sequential_pipeline(
+	istream& is, ostream& os, HeaderCache& headers, SourceFile& source, const PipelineOptions& options);
+void run_streaming_pipeline(
+	istream& is, ostream& os, HeaderCache& headers, SourceFile& source, const PipelineOptions& options);
+void run_stdin(HeaderCache& headers, OutputCache* cache, const PipelineOptions& options);
+size_t run_batch(
+	const vector<string>& input_paths, const string& output_dir,
+	HeaderCache& headers, OutputCache* cache, const PipelineOptions& options, size_t num_threads);
+
+string directoryOf(const string& path);
+string canonicalPath(const string& path);
+bool isIdentifierChar(int c);
+bool isRegularFile(const string& path);
+bool cloneOrCopyFile(const string& from, const string& to, mode_t mode);
 
 vector<string> parseParamList(istream& is);
 vector<string> parseParamList(const string& params_string);
@@ -78,38 +574,1264 @@ string readUntil(istream& from, const char* until, bool ignore_initial_whitespac
 vector<string> splitAndTrim(const string& s, char delim);
 string& trim(string& str);
 string trim(const string& str);
-string skipToNextLineIfComment(char prev_char, char c, istream& is);
-
-string generate_define(const string& params);
-
-long mathEval(istream& expr);
-long mathEval(const string& s) {
-	istringstream iss(s);
-	return mathEval(iss);
-}
+bool readCommentOrString(int prev_char, int c, istream& is, string& rest);
+template<typename Emit>
+size_t lexTokens(const char* text, size_t size, bool at_end, Emit emit);
+string readTokensUntil(TokenReader& in, char c);
+int copyParameterDecl(TokenReader& in, TokenWriter& out, bool is_localparam, ConstantEvaluator& constants);
+
+Macro generate_define(const string& params, ConstantEvaluator& constants);
+
+const char* const usage =
+	"usage: verilog_preprocessor [options] < in.v > out.v\n"
+	"       verilog_preprocessor [options] --output-dir=<dir> in.v...\n"
+	"options:\n"
+	"  -D<name>             define a macro\n"
+	"  -I<dir>              look for `include files in dir\n"
+	"  --stream             run the passes concurrently, in bounded memory\n"
+	"  --declare-used-only  only declare the elements of a 2D array that are used\n"
+	"  --output-dir=<dir>   where to put the processed input files\n"
+	"  --jobs=<n>           how many input files to process at once\n"
+	"  --cache-dir=<dir>    reuse outputs for inputs that haven't changed\n"
+	"  --cache-size=<MB>    how big the cache can get (default 1024)\n"
+	"  --cache-stats        print the cache's hits and misses\n"
+	"  --stats              print what each pass did, and how long it took\n";
 
 int main(int argc, char** argv) {
 	vector<string> predef_macros;
-	for (int i = 0; i < argc; ++i) {
+	vector<string> include_paths;
+	vector<string> input_paths;
+	string output_dir;
+	size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+	PipelineOptions options;
+	string cache_dir;
+	uint64_t cache_size_mb = 1024;
+	bool print_cache_stats = false;
+	for (int i = 1; i < argc; ++i) {
 		if (strlen(argv[i]) > 2 && argv[i][0] == '-' && argv[i][1] == 'D') {
 			predef_macros.push_back(argv[i]+2);
+		} else if (strlen(argv[i]) > 2 && argv[i][0] == '-' && argv[i][1] == 'I') {
+			include_paths.push_back(argv[i]+2);
+		} else if (strcmp(argv[i], "--stream") == 0) {
+			options.streaming = true;
+		} else if (strcmp(argv[i], "--declare-used-only") == 0) {
+			options.declare_used_only = true;
+		} else if (strncmp(argv[i], "--output-dir=", 13) == 0) {
+			output_dir = argv[i]+13;
+		} else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+			num_threads = std::max(1, atoi(argv[i]+7));
+		} else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+			cache_dir = argv[i]+12;
+		} else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+			cache_size_mb = strtoull(argv[i]+13, nullptr, 10);
+		} else if (strcmp(argv[i], "--cache-stats") == 0) {
+			print_cache_stats = true;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			options.print_stats = true;
+		} else if (argv[i][0] != '-') {
+			input_paths.push_back(argv[i]);
+		} else {
+			cerr << "unknown option " << argv[i] << "\n" << usage;
+			return 1;
+		}
+	}
+
+	ios::sync_with_stdio(false);
+	HeaderCache headers(predef_macros, include_paths);
+	unique_ptr<OutputCache> cache;
+	if (!cache_dir.empty()) {
+		if (mkdir(cache_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+			cerr << "couldn't create cache directory " << cache_dir << ": " << strerror(errno) << "\n";
+			return 1;
+		}
+		cache.reset(new OutputCache(
+			cache_dir, cache_size_mb * 1024 * 1024, predef_macros, include_paths, options));
+	}
+
+	int exit_code = 0;
+	if (!input_paths.empty()) {
+		if (output_dir.empty()) {
+			cerr << "need an --output-dir=<dir> to put the processed input files in\n";
+			return 1;
+		}
+		size_t num_failed = run_batch(
+			input_paths, output_dir, headers, cache.get(), options, num_threads);
+		exit_code = (num_failed == 0) ? 0 : 1;
+	} else {
+		try {
+			run_stdin(headers, cache.get(), options);
+		} catch (const std::exception& e) {
+			cerr << e.what() << "\n";
+			exit_code = 1;
+		}
+	}
+
+	if (cache) {
+		cache->evict();
+		if (print_cache_stats) {
+			cache->printStats(cerr);
+		}
+	}
+	return exit_code;
+}
+
+void run_stdin(HeaderCache& headers, OutputCache* cache, const PipelineOptions& options) {
+	SourceFile source(".");
+	PipelineStats stats;
+	if (options.print_stats) {
+		source.stats = &stats;
+	}
+	FileDescriptorInBuf input_buf(STDIN_FILENO);
+
+	if (!cache) {
+		istream input(&input_buf);
+		if (options.streaming) {
+			run_streaming_pipeline(input, cout, headers, source, options);
+		} else {
+			run_sequential_pipeline(input, cout, headers, source, options);
+		}
+		if (options.print_stats) {
+			cout.flush();
+			stats.print(cerr, "-");
+		}
+		return;
+	}
+
+	// has to all be read before it can be hashed
+	string input_text((istreambuf_iterator<char>(&input_buf)), istreambuf_iterator<char>());
+	string key = cache->makeKey(
+		OutputCache::hashBytes(input_text.data(), input_text.size()), canonicalPath(source.dir));
+	string cached_output = cache->lookup(key);
+	if (!cached_output.empty()) {
+		ifstream cached_output_stream(cached_output, ios::binary);
+		if (cached_output_stream) {
+			cout << cached_output_stream.rdbuf();
+			if (options.print_stats) {
+				cout.flush();
+				stats.from_cache = true;
+				stats.print(cerr, "-");
+			}
+			return;
+		}
+	}
+
+	istringstream input(input_text);
+	ostringstream output;
+	if (options.streaming) {
+		run_streaming_pipeline(input, output, headers, source, options);
+	} else {
+		run_sequential_pipeline(input, output, headers, source, options);
+	}
+	cout << output.str();
+	cache->storeText(key, source.included_files, source.missing_files, output.str());
+	if (options.print_stats) {
+		cout.flush();
+		stats.print(cerr, "-");
+	}
+}
+
+const size_t stream_chunk_size = 64 * 1024;
+const size_t stream_queue_capacity = 16;
+const size_t stream_putback_size = 4096;
+const size_t stream_spins_before_waiting = 128;
+
+/**
+ * A bounded, single-producer single-consumer queue of token chunks. Lock-free
+ * while both sides keep up; a full (or empty) queue makes the producer (or
+ * consumer) yield for a little while, and then sleep until the other side
+ * catches up, so a stalled pass doesn't keep a core busy. close() marks the end
+ * of the stream, and pop() returns false once everything pushed before it has
+ * been consumed.
+ */
+class ChunkQueue : public TokenSink, public TokenSource {
+public:
+	explicit ChunkQueue(size_t capacity)
+		: slots(capacity + 1)
+		, head(0)
+		, tail(0)
+		, closed(false)
+		, queued_bytes(0)
+		, peak_queued_bytes(0)
+		, num_waiting(0)
+		, waiting_mutex()
+		, waiting_cv() { }
+	void push(TokenChunk&& chunk) override {
+		size_t this_tail = tail.load(std::memory_order_relaxed);
+		size_t next_tail = (this_tail + 1) % slots.size();
+		waitUntil([&]() { return next_tail != head.load(std::memory_order_acquire); });
+		size_t chunk_bytes = chunk.getNumBytes();
+		size_t now_queued = queued_bytes.fetch_add(chunk_bytes, std::memory_order_relaxed) + chunk_bytes;
+		if (now_queued > peak_queued_bytes) {
+			peak_queued_bytes = now_queued; // only the producer writes this
+		}
+		slots[this_tail] = std::move(chunk);
+		tail.store(next_tail, std::memory_order_release);
+		wakeWaiting();
+	}
+	bool pop(TokenChunk& chunk) override {
+		size_t this_head = head.load(std::memory_order_relaxed);
+		waitUntil([&]() {
+			return this_head != tail.load(std::memory_order_acquire) || closed.load(std::memory_order_acquire);
+		});
+		// everything pushed before close() is visible once closed is, so check once more
+		if (this_head == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		chunk = std::move(slots[this_head]);
+		slots[this_head] = TokenChunk();
+		queued_bytes.fetch_sub(chunk.getNumBytes(), std::memory_order_relaxed);
+		head.store((this_head + 1) % slots.size(), std::memory_order_release);
+		wakeWaiting();
+		return true;
+	}
+	void close() override {
+		closed.store(true, std::memory_order_release);
+		wakeWaiting();
+	}
+	/// read once the producer is done
+	size_t getPeakQueuedBytes() const { return peak_queued_bytes; }
+private:
+	template<typename Ready>
+	void waitUntil(Ready ready) {
+		for (size_t spins = 0; spins < stream_spins_before_waiting; ++spins) {
+			if (ready()) {
+				return;
+			}
+			std::this_thread::yield();
+		}
+		std::unique_lock<std::mutex> lock(waiting_mutex);
+		num_waiting.fetch_add(1);
+		// pairs with the fence in wakeWaiting(), so that one of us sees the other
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		waiting_cv.wait(lock, ready);
+		num_waiting.fetch_sub(1);
+	}
+	/// call after changing head, tail or closed
+	void wakeWaiting() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (num_waiting.load(std::memory_order_relaxed) != 0) {
+			// a waiter holds the lock from its last check until it's asleep, so can't miss this
+			std::lock_guard<std::mutex> lock(waiting_mutex);
+			waiting_cv.notify_all();
+		}
+	}
+	vector<TokenChunk> slots;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<bool> closed;
+	std::atomic<size_t> queued_bytes;
+	size_t peak_queued_bytes;
+	std::atomic<size_t> num_waiting;
+	std::mutex waiting_mutex;
+	std::condition_variable waiting_cv;
+	ChunkQueue(const ChunkQueue&) = delete;
+	ChunkQueue& operator=(const ChunkQueue&) = delete;
+};
+
+/**
+ * Lexes what's written to it, and pushes the tokens onto a TokenSink a chunk at a
+ * time. The last token in the buffer might carry on in what's written next, so it's
+ * held back until then. Call close() when the pass writing to it is done.
+ */
+class LexingOutBuf : public streambuf {
+public:
+	LexingOutBuf(TokenSink& sink_)
+		: sink(sink_)
+		, buffer(stream_chunk_size)
+		, num_bytes(0) {
+		setp(buffer.data(), buffer.data() + buffer.size());
+	}
+	void close() {
+		pushLexed(true);
+		sink.close();
+	}
+	uint64_t getNumBytes() const { return num_bytes + (pptr() - pbase()); }
+protected:
+	int_type overflow(int_type c) override {
+		pushLexed(false);
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+private:
+	void pushLexed(bool at_end) {
+		size_t num_buffered = pptr() - pbase();
+		TokenChunk chunk;
+		size_t num_lexed = lexTokens(buffer.data(), num_buffered, at_end, [&](const Token& token) {
+			chunk.appendCode(token);
+		});
+		num_bytes += num_lexed;
+
+		// the lexed part of the buffer becomes the chunk's text
+		size_t num_held_back = num_buffered - num_lexed;
+		vector<char> next_buffer(std::max(stream_chunk_size, 2 * num_held_back));
+		std::copy(buffer.data() + num_lexed, buffer.data() + num_buffered, next_buffer.data());
+		if (!chunk.codes.empty()) {
+			buffer.resize(num_lexed);
+			chunk.text = std::move(buffer);
+			sink.push(std::move(chunk));
+		}
+		buffer.swap(next_buffer);
+		setp(buffer.data(), buffer.data() + buffer.size());
+		pbump(static_cast<int>(num_held_back));
+	}
+	TokenSink& sink;
+	vector<char> buffer;
+	uint64_t num_bytes; // lexed so far
+	LexingOutBuf(const LexingOutBuf&) = delete;
+	LexingOutBuf& operator=(const LexingOutBuf&) = delete;
+};
+
+/**
+ * Holds tokens in memory, for the sequential pipeline.
+ */
+class TokenBuffer : public TokenStore {
+public:
+	TokenBuffer() : chunks(), num_bytes(0) { }
+	void push(TokenChunk&& chunk) override {
+		num_bytes += chunk.getNumBytes();
+		chunks.push_back(std::move(chunk));
+	}
+	void close() override { }
+	bool pop(TokenChunk& chunk) override {
+		if (chunks.empty()) {
+			return false;
+		}
+		chunk = std::move(chunks.front());
+		chunks.pop_front();
+		return true;
+	}
+	uint64_t getNumBytes() const override { return num_bytes; }
+private:
+	deque<TokenChunk> chunks;
+	uint64_t num_bytes;
+	TokenBuffer(const TokenBuffer&) = delete;
+	TokenBuffer& operator=(const TokenBuffer&) = delete;
+};
+
+/**
+ * Passes what's written to it on to target a chunk at a time, counting it.
+ */
+class CountingOutBuf : public streambuf {
+public:
+	CountingOutBuf(streambuf& target_)
+		: target(target_)
+		, buffer(stream_chunk_size)
+		, count(0) {
+		setp(buffer.data(), buffer.data() + buffer.size());
+	}
+	~CountingOutBuf() { writeBuffered(); }
+	uint64_t getCount() const { return count + (pptr() - pbase()); }
+protected:
+	int_type overflow(int_type c) override {
+		writeBuffered();
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+	int sync() override {
+		writeBuffered();
+		return target.pubsync();
+	}
+private:
+	void writeBuffered() {
+		count += pptr() - pbase();
+		target.sputn(pbase(), pptr() - pbase());
+		setp(buffer.data(), buffer.data() + buffer.size());
+	}
+	streambuf& target;
+	vector<char> buffer;
+	uint64_t count;
+	CountingOutBuf(const CountingOutBuf&) = delete;
+	CountingOutBuf& operator=(const CountingOutBuf&) = delete;
+};
+
+/**
+ * Reads from source a chunk at a time, counting what's been consumed. Keeps the
+ * tail of the last chunk for putback(), like FileDescriptorInBuf.
+ */
+class CountingInBuf : public streambuf {
+public:
+	CountingInBuf(streambuf& source_)
+		: source(source_)
+		, buffer(stream_putback_size + stream_chunk_size)
+		, count(0) {
+		setg(buffer.data(), buffer.data(), buffer.data());
+	}
+	uint64_t getCount() const { return count - (egptr() - gptr()); }
+protected:
+	int_type underflow() override {
+		if (gptr() < egptr()) {
+			return traits_type::to_int_type(*gptr());
+		}
+		size_t keep = std::min<size_t>(stream_putback_size, gptr() - eback());
+		std::memmove(buffer.data(), gptr() - keep, keep);
+		std::streamsize num_read = source.sgetn(buffer.data() + keep, stream_chunk_size);
+		if (num_read <= 0) {
+			setg(buffer.data(), buffer.data() + keep, buffer.data() + keep);
+			return traits_type::eof();
+		}
+		count += num_read;
+		setg(buffer.data(), buffer.data() + keep, buffer.data() + keep + num_read);
+		return traits_type::to_int_type(*gptr());
+	}
+private:
+	streambuf& source;
+	vector<char> buffer;
+	uint64_t count;
+	CountingInBuf(const CountingInBuf&) = delete;
+	CountingInBuf& operator=(const CountingInBuf&) = delete;
+};
+
+/// reads text that's already in memory, from wherever it's told to
+class MemoryInBuf : public streambuf {
+public:
+	MemoryInBuf(const char* text, size_t size) {
+		// never written to; putback() only steps back over what was just read
+		char* begin = const_cast<char*>(text);
+		setg(begin, begin, begin + size);
+	}
+	void seek(size_t pos) { setg(eback(), eback() + pos, egptr()); }
+	size_t tell() const { return gptr() - eback(); }
+private:
+	MemoryInBuf(const MemoryInBuf&) = delete;
+	MemoryInBuf& operator=(const MemoryInBuf&) = delete;
+};
+
+
+/**
+ * Runs pass(), timing it.
+ */
+template<typename Pass>
+void runPass(PassStats& stats, Pass pass) {
+	auto start = std::chrono::steady_clock::now();
+	pass();
+	stats.wall_ms = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * The passes, hooked up to their input and output. The first pass reads text and
+ * the last writes it; with --stats (count_bytes), those are wrapped to count what
+ * goes through them. The tokens in between are counted anyway. The output is
+ * closed only if the pass finishes; a caller that carries on after a failure has
+ * to close it too.
+ */
+void expandMacros(
+	istream& is, LexingOutBuf& out_buf, HeaderCache& headers, SourceFile& source,
+	PassStats& stats, bool count_bytes
+) {
+	ostream out(&out_buf);
+	runPass(stats, [&]() {
+		if (count_bytes) {
+			CountingInBuf in_buf(*is.rdbuf());
+			istream in(&in_buf);
+			macro_expansion_pass(in, out, headers, source, stats);
+			stats.bytes_in = in_buf.getCount();
+		} else {
+			macro_expansion_pass(is, out, headers, source, stats);
+		}
+		out_buf.close();
+	});
+	stats.bytes_out = out_buf.getNumBytes();
+}
+
+template<typename Pass>
+void transformTokens(TokenReader& in, TokenWriter& out, PassStats& stats, Pass pass) {
+	runPass(stats, [&]() {
+		pass(in, out);
+		out.close();
+	});
+	stats.bytes_in = in.getNumBytesRead();
+	stats.bytes_out = out.getNumBytesWritten();
+}
+
+void applyFinalTouches(TokenReader& in, ostream& os, PassStats& stats, bool count_bytes) {
+	runPass(stats, [&]() {
+		if (count_bytes) {
+			CountingOutBuf out_buf(*os.rdbuf());
+			ostream out(&out_buf);
+			final_touches_pass(in, out);
+			out.flush();
+			stats.bytes_out = out_buf.getCount();
+		} else {
+			final_touches_pass(in, os);
+		}
+	});
+	stats.bytes_in = in.getNumBytesRead();
+}
+
+const char* const pass_names[4] = {
+	"macro_expansion", "module_redeclaration", "twodim_reduction", "final_touches",
+};
+
+void printJsonString(ostream& os, const string& s) {
+	os << '"';
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			os << '\\' << c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			static const char* const hex_digits = "0123456789abcdef";
+			os << "\\u00" << hex_digits[(c >> 4) & 0xf] << hex_digits[c & 0xf];
+		} else {
+			os << c;
 		}
 	}
+	os << '"';
+}
+
+void PipelineStats::print(ostream& os, const string& file_name) const {
+	ostringstream line;
+	line << "{\"file\":";
+	printJsonString(line, file_name);
+	line << ",\"pipeline\":\"" << (streaming ? "streaming" : "sequential") << '"';
+	line << ",\"from_cache\":" << (from_cache ? "true" : "false");
+	line << ",\"passes\":[";
+	if (!from_cache) {
+		for (size_t i = 0; i < 4; ++i) {
+			const PassStats& pass = passes[i];
+			line
+				<< (i == 0 ? "" : ",")
+				<< "{\"name\":\"" << pass_names[i] << '"'
+				<< ",\"wall_ms\":" << std::fixed << std::setprecision(3) << pass.wall_ms
+				<< ",\"bytes_in\":" << pass.bytes_in
+				<< ",\"bytes_out\":" << pass.bytes_out
+				<< ",\"peak_buffer_bytes\":" << pass.peak_buffer_bytes
+				<< ",\"macro_expansions\":" << pass.macro_expansions
+				<< ",\"gendefines_generated\":" << pass.gendefines_generated
+				<< ",\"twodims_found\":" << pass.twodims_found
+				<< ",\"indices_rewritten\":" << pass.indices_rewritten
+				<< '}'
+			;
+		}
+	}
+	line << "]}\n";
+	os << line.str();
+	os.flush();
+}
+
 
-	stringstream with_reduced_twodims;
+void run_sequential_pipeline(
+	istream& is, ostream& os, HeaderCache& headers, SourceFile& source, const PipelineOptions& options
+) {
+	PipelineStats unused_stats;
+	PipelineStats& stats = source.stats ? *source.stats : unused_stats;
+	bool count_bytes = (source.stats != nullptr);
+	stats.streaming = false;
+
+	TokenBuffer with_reduced_twodims;
 	{
-		stringstream with_redeclared_modules;
+		TokenBuffer with_redeclared_modules;
 		{
-			stringstream with_expanded_macros;
+			TokenBuffer with_expanded_macros;
 			{
-				macro_expansion_pass(cin, with_expanded_macros, predef_macros);
+				LexingOutBuf out_buf(with_expanded_macros);
+				expandMacros(is, out_buf, headers, source, stats.passes[0], count_bytes);
+				stats.passes[0].peak_buffer_bytes = with_expanded_macros.getNumBytes();
 			}
-			module_redeclaration_pass(with_expanded_macros, with_redeclared_modules);
+			TokenReader in(with_expanded_macros);
+			TokenWriter out(with_redeclared_modules);
+			transformTokens(in, out, stats.passes[1], module_redeclaration_pass);
+			stats.passes[1].peak_buffer_bytes = with_redeclared_modules.getNumBytes();
 		}
-		twodim_reduction_pass(with_redeclared_modules, with_reduced_twodims);
+		TokenBuffer with_redecl;
+		TokenBuffer with_rewritten_uses;
+		TokenBuffer* rewritten_scratch = options.declare_used_only ? &with_rewritten_uses : nullptr;
+		TokenReader in(with_redeclared_modules);
+		TokenWriter out(with_reduced_twodims);
+		transformTokens(in, out, stats.passes[2], [&](TokenReader& pass_in, TokenWriter& pass_out) {
+			twodim_reduction_pass(pass_in, pass_out, with_redecl, rewritten_scratch, stats.passes[2]);
+		});
+		// the staged tokens are held on to as well, until the pass is done
+		stats.passes[2].peak_buffer_bytes =
+			with_reduced_twodims.getNumBytes() + with_redecl.getNumBytes() + with_rewritten_uses.getNumBytes();
+	}
+	TokenReader in(with_reduced_twodims);
+	applyFinalTouches(in, os, stats.passes[3], count_bytes);
+}
+
+FileDescriptorInBuf::FileDescriptorInBuf(int fd_, bool owns_fd_)
+	: fd(fd_)
+	, owns_fd(owns_fd_)
+	, mapped_data(nullptr)
+	, mapped_size(0)
+	, buffer() {
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+		void* mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED) {
+			mapped_data = static_cast<char*>(mapping);
+			mapped_size = file_stat.st_size;
+			madvise(mapping, mapped_size, MADV_SEQUENTIAL);
+			setg(mapped_data, mapped_data, mapped_data + mapped_size);
+			return;
+		}
+	}
+	buffer.resize(stream_putback_size + stream_chunk_size);
+	setg(buffer.data(), buffer.data(), buffer.data());
+}
+
+FileDescriptorInBuf::~FileDescriptorInBuf() {
+	if (mapped_data) {
+		munmap(mapped_data, mapped_size);
+	}
+	if (owns_fd) {
+		::close(fd);
 	}
-	final_touches_pass(with_reduced_twodims,cout);
-	return 0;
+}
+
+FileDescriptorInBuf::int_type FileDescriptorInBuf::underflow() {
+	if (gptr() < egptr()) {
+		return traits_type::to_int_type(*gptr());
+	}
+	if (mapped_data) {
+		return traits_type::eof();
+	}
+
+	// keep some of what was just read, so that it can be put back
+	size_t keep = std::min<size_t>(stream_putback_size, gptr() - eback());
+	std::copy(gptr() - keep, gptr(), buffer.data());
+	ssize_t num_read = 0;
+	do {
+		num_read = read(fd, buffer.data() + keep, buffer.size() - keep);
+	} while (num_read == -1 && errno == EINTR);
+	if (num_read <= 0) {
+		return traits_type::eof();
+	}
+	setg(buffer.data(), buffer.data() + keep, buffer.data() + keep + num_read);
+	return traits_type::to_int_type(*gptr());
+}
+
+/**
+ * A scratch stream backed by an (already unlinked) temporary file, so that a pass
+ * that has to see all of its input before producing output doesn't hold it in memory.
+ */
+class TemporaryFileStream : public fstream {
+public:
+	TemporaryFileStream() : fstream() {
+		const char* tmpdir = getenv("TMPDIR");
+		string path_template = string(tmpdir ? tmpdir : "/tmp") + "/verilog_preprocessor.XXXXXX";
+		vector<char> path(path_template.begin(), path_template.end());
+		path.push_back('\0');
+		int fd = mkstemp(path.data());
+		if (fd == -1) {
+			throw std::runtime_error("couldn't create a temporary file in " + path_template);
+		}
+		open(path.data(), ios::in | ios::out | ios::trunc | ios::binary);
+		::close(fd);
+		unlink(path.data());
+		if (!is_open()) {
+			throw std::runtime_error("couldn't open temporary file " + string(path.data()));
+		}
+	}
+};
+
+/**
+ * Keeps tokens in a TemporaryFileStream, for the streaming pipeline. Each chunk is
+ * written as the sizes of its codes and text, and then those.
+ */
+class TokenFile : public TokenStore {
+public:
+	TokenFile() : file(), num_bytes(0) { }
+	void push(TokenChunk&& chunk) override {
+		uint64_t header[2] = {chunk.codes.size(), chunk.text.size()};
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(chunk.codes.data()), chunk.codes.size());
+		file.write(chunk.text.data(), chunk.text.size());
+		num_bytes += chunk.getNumBytes();
+	}
+	void close() override {
+		file.flush();
+		file.seekg(0);
+		if (!file) {
+			throw std::runtime_error("couldn't write to a temporary file");
+		}
+	}
+	bool pop(TokenChunk& chunk) override {
+		uint64_t header[2];
+		if (!file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+			return false;
+		}
+		chunk = TokenChunk();
+		chunk.codes.resize(header[0]);
+		chunk.text.resize(header[1]);
+		file.read(reinterpret_cast<char*>(chunk.codes.data()), chunk.codes.size());
+		file.read(chunk.text.data(), chunk.text.size());
+		if (!file) {
+			throw std::runtime_error("couldn't read back a temporary file");
+		}
+		return true;
+	}
+	uint64_t getNumBytes() const override { return num_bytes; }
+private:
+	TemporaryFileStream file;
+	uint64_t num_bytes;
+	TokenFile(const TokenFile&) = delete;
+	TokenFile& operator=(const TokenFile&) = delete;
+};
+
+void run_streaming_pipeline(
+	istream& is, ostream& os, HeaderCache& headers, SourceFile& source, const PipelineOptions& options
+) {
+	PipelineStats unused_stats;
+	PipelineStats& stats = source.stats ? *source.stats : unused_stats;
+	bool count_bytes = (source.stats != nullptr);
+	stats.streaming = true;
+
+	ChunkQueue expanded_macros(stream_queue_capacity);
+	ChunkQueue redeclared_modules(stream_queue_capacity);
+	ChunkQueue reduced_twodims(stream_queue_capacity);
+	// one per pass. A pass that fails still closes its output, so the rest finish.
+	std::exception_ptr pass_errors[4];
+
+	std::thread macro_expansion_thread([&]() {
+		LexingOutBuf out_buf(expanded_macros);
+		try {
+			expandMacros(is, out_buf, headers, source, stats.passes[0], count_bytes);
+		} catch (...) {
+			pass_errors[0] = std::current_exception();
+		}
+		out_buf.close();
+	});
+	std::thread module_redeclaration_thread([&]() {
+		TokenReader in(expanded_macros);
+		TokenWriter out(redeclared_modules);
+		try {
+			transformTokens(in, out, stats.passes[1], module_redeclaration_pass);
+		} catch (...) {
+			pass_errors[1] = std::current_exception();
+		}
+		out.close();
+	});
+	std::thread twodim_reduction_thread([&]() {
+		TokenReader in(redeclared_modules);
+		TokenWriter out(reduced_twodims);
+		try {
+			TokenFile with_redecl;
+			unique_ptr<TokenFile> with_rewritten_uses;
+			if (options.declare_used_only) {
+				with_rewritten_uses.reset(new TokenFile());
+			}
+			transformTokens(in, out, stats.passes[2], [&](TokenReader& pass_in, TokenWriter& pass_out) {
+				twodim_reduction_pass(pass_in, pass_out, with_redecl, with_rewritten_uses.get(), stats.passes[2]);
+			});
+		} catch (...) {
+			pass_errors[2] = std::current_exception();
+		}
+		out.close();
+	});
+	try {
+		TokenReader in(reduced_twodims);
+		applyFinalTouches(in, os, stats.passes[3], count_bytes);
+	} catch (...) {
+		pass_errors[3] = std::current_exception();
+	}
+
+	macro_expansion_thread.join();
+	module_redeclaration_thread.join();
+	twodim_reduction_thread.join();
+	stats.passes[0].peak_buffer_bytes = expanded_macros.getPeakQueuedBytes();
+	stats.passes[1].peak_buffer_bytes = redeclared_modules.getPeakQueuedBytes();
+	stats.passes[2].peak_buffer_bytes = reduced_twodims.getPeakQueuedBytes();
+
+	// the earliest failure is the interesting one; the later passes just saw truncated input
+	for (const auto& pass_error : pass_errors) {
+		if (pass_error) {
+			std::rethrow_exception(pass_error);
+		}
+	}
+}
+
+struct BatchJob {
+	string input_path;
+	string output_path;
+	off_t input_size;
+};
+
+vector<BatchJob> makeBatchJobs(
+	const vector<string>& input_paths, const string& output_dir, size_t& num_skipped);
+void preprocessFile(
+	const BatchJob& job, HeaderCache& headers, OutputCache* cache,
+	const PipelineOptions& options, PipelineStats* stats);
+
+/**
+ * Preprocesses every input (directories are searched for .v files) into output_dir,
+ * on num_threads threads that each take the next unclaimed file until there are none
+ * left. Biggest files go first, so that one doesn't end up running on its own at the
+ * end. Errors are reported per file, and the number of files that failed is returned.
+ */
+size_t run_batch(
+	const vector<string>& input_paths, const string& output_dir,
+	HeaderCache& headers, OutputCache* cache, const PipelineOptions& options, size_t num_threads
+) {
+	if (mkdir(output_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+		cerr << "couldn't create output directory " << output_dir << ": " << strerror(errno) << "\n";
+		return input_paths.size();
+	}
+
+	size_t num_skipped = 0;
+	vector<BatchJob> jobs = makeBatchJobs(input_paths, output_dir, num_skipped);
+	std::atomic<size_t> next_job(0);
+	std::atomic<size_t> num_failed(num_skipped);
+	std::mutex cerr_mutex;
+
+	auto worker = [&]() {
+		while (true) {
+			size_t job_index = next_job.fetch_add(1);
+			if (job_index >= jobs.size()) {
+				break;
+			}
+			const BatchJob& job = jobs[job_index];
+			try {
+				PipelineStats stats;
+				preprocessFile(job, headers, cache, options, options.print_stats ? &stats : nullptr);
+				if (options.print_stats) {
+					std::lock_guard<std::mutex> lock(cerr_mutex);
+					stats.print(cerr, job.input_path);
+				}
+			} catch (const std::exception& e) {
+				std::lock_guard<std::mutex> lock(cerr_mutex);
+				cerr << job.input_path << ": " << e.what() << "\n";
+				++num_failed;
+			}
+		}
+	};
+
+	vector<std::thread> workers;
+	for (size_t i = 1; i < std::min(num_threads, jobs.size()); ++i) {
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (auto& worker_thread : workers) {
+		worker_thread.join();
+	}
+
+	if (num_failed != 0) {
+		cerr << num_failed << " of " << (jobs.size() + num_skipped) << " files failed\n";
+	}
+	return num_failed;
+}
+
+vector<BatchJob> makeBatchJobs(
+	const vector<string>& input_paths, const string& output_dir, size_t& num_skipped
+) {
+	vector<string> files;
+	for (const string& input_path : input_paths) {
+		struct stat input_stat;
+		if (stat(input_path.c_str(), &input_stat) != 0) {
+			cerr << input_path << ": " << strerror(errno) << "\n";
+			++num_skipped;
+		} else if (S_ISDIR(input_stat.st_mode)) {
+			vector<string> dir_files;
+			if (DIR* dir = opendir(input_path.c_str())) {
+				while (struct dirent* entry = readdir(dir)) {
+					string name = entry->d_name;
+					if (name.size() > 2 && name.compare(name.size() - 2, 2, ".v") == 0) {
+						dir_files.push_back(input_path + "/" + name);
+					}
+				}
+				closedir(dir);
+			}
+			std::sort(dir_files.begin(), dir_files.end());
+			files.insert(files.end(), dir_files.begin(), dir_files.end());
+		} else {
+			files.push_back(input_path);
+		}
+	}
+
+	vector<BatchJob> jobs;
+	unordered_map<string,string> output2input;
+	for (const string& file : files) {
+		BatchJob job;
+		job.input_path = file;
+		string file_name = file.substr(file.find_last_of('/') + 1);
+		job.output_path = output_dir + "/" + file_name.substr(0, file_name.find_last_of('.')) + ".vv";
+		struct stat input_stat;
+		job.input_size = (stat(file.c_str(), &input_stat) == 0) ? input_stat.st_size : 0;
+
+		auto inserted = output2input.insert(make_pair(job.output_path, file));
+		if (!inserted.second) {
+			cerr
+				<< file << ": would overwrite the output of " << inserted.first->second
+				<< " (" << job.output_path << ")\n";
+			++num_skipped;
+			continue;
+		}
+		jobs.push_back(job);
+	}
+
+	std::stable_sort(jobs.begin(), jobs.end(), [](const BatchJob& lhs, const BatchJob& rhs) {
+		return lhs.input_size > rhs.input_size;
+	});
+	return jobs;
+}
+
+/**
+ * The output is written to a temporary file that is renamed into place, so a
+ * failed file leaves nothing behind. The temporary file's name is unique to this
+ * process and job, in case another run is writing to the same output directory.
+ */
+void preprocessFile(
+	const BatchJob& job, HeaderCache& headers, OutputCache* cache,
+	const PipelineOptions& options, PipelineStats* stats
+) {
+	static std::atomic<size_t> next_temporary_id(0);
+	ostringstream temporary_path_builder;
+	temporary_path_builder << job.output_path << ".tmp." << getpid() << "." << next_temporary_id++;
+	string temporary_path = temporary_path_builder.str();
+	SourceFile source(directoryOf(job.input_path));
+	source.stats = stats;
+
+	string cache_key;
+	if (cache) {
+		string input_hash = OutputCache::hashFile(job.input_path);
+		if (input_hash.empty()) {
+			throw std::runtime_error(string("couldn't read: ") + strerror(errno));
+		}
+		cache_key = cache->makeKey(input_hash, directoryOf(canonicalPath(job.input_path)));
+		string cached_output = cache->lookup(cache_key);
+		if (
+			!cached_output.empty()
+			&& cloneOrCopyFile(cached_output, temporary_path, 0666)
+			&& rename(temporary_path.c_str(), job.output_path.c_str()) == 0
+		) {
+			if (stats) {
+				stats->from_cache = true;
+			}
+			return;
+		}
+		unlink(temporary_path.c_str());
+	}
+
+	int fd = open(job.input_path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		throw std::runtime_error(string("couldn't open: ") + strerror(errno));
+	}
+	FileDescriptorInBuf input_buf(fd, true);
+	istream input(&input_buf);
+
+	try {
+		ofstream output(temporary_path, ios::out | ios::trunc | ios::binary);
+		if (!output) {
+			throw std::runtime_error("couldn't open " + temporary_path + " for writing");
+		}
+		if (options.streaming) {
+			run_streaming_pipeline(input, output, headers, source, options);
+		} else {
+			run_sequential_pipeline(input, output, headers, source, options);
+		}
+		output.close();
+		if (!output) {
+			throw std::runtime_error("couldn't write " + temporary_path);
+		}
+		if (rename(temporary_path.c_str(), job.output_path.c_str()) != 0) {
+			throw std::runtime_error("couldn't rename " + temporary_path + " to " + job.output_path);
+		}
+	} catch (...) {
+		unlink(temporary_path.c_str());
+		throw;
+	}
+
+	if (cache) {
+		cache->store(cache_key, source.included_files, source.missing_files, job.output_path);
+	}
+}
+
+/**
+ * A fast 128 bit hash for telling file contents apart; two differently seeded
+ * FNV-1a style lanes, mixed together at the end. Not meant to stand up to someone
+ * trying to make collisions.
+ */
+class ContentHash {
+public:
+	ContentHash() : lane_a(0xcbf29ce484222325ULL), lane_b(0x84222325cbf29ce4ULL), length(0) { }
+	void update(const char* data, size_t size) {
+		for (size_t i = 0; i < size; ++i) {
+			uint64_t c = static_cast<unsigned char>(data[i]);
+			lane_a = (lane_a ^ c) * 0x100000001b3ULL;
+			lane_b = (lane_b ^ c) * 0x9e3779b97f4a7c15ULL;
+		}
+		length += size;
+	}
+	string hexDigest() {
+		uint64_t a = mix(lane_a ^ length);
+		uint64_t b = mix(lane_b ^ a);
+		char digest[33];
+		snprintf(digest, sizeof(digest), "%016llx%016llx",
+			static_cast<unsigned long long>(a), static_cast<unsigned long long>(b));
+		return digest;
+	}
+private:
+	static uint64_t mix(uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+	uint64_t lane_a;
+	uint64_t lane_b;
+	uint64_t length;
+};
+
+/**
+ * Goes into every cache key. Bump cache_format_version whenever the same input
+ * would come out differently. The Makefile also passes in a hash of the source, so
+ * a change that forgets to still doesn't get served what an older build cached.
+ */
+const char* const cache_format_version = "1";
+#ifndef VERILOG_PREPROCESSOR_SOURCE_HASH
+#define VERILOG_PREPROCESSOR_SOURCE_HASH ""
+#endif
+
+OutputCache::OutputCache(
+	const string& dir_, uint64_t max_size_, const vector<string>& predef_macros,
+	const vector<string>& include_paths, const PipelineOptions& options
+)
+	: dir(dir_)
+	, max_size(max_size_)
+	, base_key()
+	, num_hits(0)
+	, num_misses(0)
+	, num_stores(0)
+	, num_evicted(0)
+	, next_temporary_id(0) {
+	// '\0's keep the fields from running into each other
+	base_key = string(cache_format_version) + '\0' + VERILOG_PREPROCESSOR_SOURCE_HASH + '\0';
+	for (const string& predef_macro : predef_macros) {
+		base_key += "-D" + predef_macro + '\0';
+	}
+	for (const string& include_path : include_paths) {
+		base_key += "-I" + canonicalPath(include_path) + '\0';
+	}
+	if (options.declare_used_only) {
+		base_key += string("--declare-used-only") + '\0';
+	}
+}
+
+string OutputCache::makeKey(const string& input_hash, const string& input_dir) {
+	// the input's directory is the first place `include's are looked for
+	string key_text = base_key + input_dir + '\0' + input_hash;
+	return hashBytes(key_text.data(), key_text.size());
+}
+
+string OutputCache::lookup(const string& key) {
+	string deps_path = dir + "/" + key + ".deps";
+	ifstream deps_stream(deps_path, ios::binary);
+	if (!deps_stream) {
+		++num_misses;
+		return "";
+	}
+	string deps((istreambuf_iterator<char>(deps_stream)), istreambuf_iterator<char>());
+
+	// each line is "<hash> <path>" for an `include'd file, which has to be unchanged,
+	// or "- <path>" for somewhere one was looked for, which has to still be empty
+	istringstream deps_lines(deps);
+	string line;
+	while (getline(deps_lines, line)) {
+		string::size_type space = line.find(' ');
+		string path = (space == string::npos) ? "" : line.substr(space + 1);
+		bool unchanged =
+			(space == 1 && line[0] == '-')
+				? !isRegularFile(path)
+				: (space != string::npos && hashFile(path) == line.substr(0, space));
+		if (!unchanged) {
+			++num_misses;
+			return "";
+		}
+	}
+
+	string key_text = key + '\0' + deps;
+	string output_path = dir + "/" + hashBytes(key_text.data(), key_text.size()) + ".vv";
+	// touching it marks it as recently used, and makes sure it hasn't been evicted
+	if (utimensat(AT_FDCWD, output_path.c_str(), nullptr, 0) != 0) {
+		++num_misses;
+		return "";
+	}
+	utimensat(AT_FDCWD, deps_path.c_str(), nullptr, 0);
+	++num_hits;
+	return output_path;
+}
+
+/**
+ * Returns where the output for key should go, and fills in the contents of its
+ * .deps file, or returns "" if an `include'd file can't be read anymore.
+ */
+string OutputCache::prepareEntry(
+	const string& key, const vector<string>& included_files, const vector<string>& missing_files,
+	string& deps
+) {
+	deps.clear();
+	for (const string& included_file : included_files) {
+		string file_hash = hashFile(included_file);
+		if (file_hash.empty()) {
+			return "";
+		}
+		deps += file_hash + " " + included_file + "\n";
+	}
+	for (const string& missing_file : missing_files) {
+		if (isRegularFile(missing_file)) {
+			return ""; // appeared while the input was being processed
+		}
+		deps += "- " + missing_file + "\n";
+	}
+	string key_text = key + '\0' + deps;
+	return dir + "/" + hashBytes(key_text.data(), key_text.size()) + ".vv";
+}
+
+/**
+ * The .deps file goes in last, as that's what makes the entry visible.
+ */
+void OutputCache::commitEntry(const string& key, const string& deps) {
+	string temporary_path = makeTemporaryPath();
+	ofstream deps_stream(temporary_path, ios::out | ios::trunc | ios::binary);
+	deps_stream << deps;
+	deps_stream.close();
+	if (deps_stream.fail() || rename(temporary_path.c_str(), (dir + "/" + key + ".deps").c_str()) != 0) {
+		unlink(temporary_path.c_str());
+		return;
+	}
+	++num_stores;
+}
+
+void OutputCache::store(
+	const string& key, const vector<string>& included_files, const vector<string>& missing_files,
+	const string& output_path
+) {
+	string deps;
+	string cached_output = prepareEntry(key, included_files, missing_files, deps);
+	if (cached_output.empty()) {
+		return;
+	}
+	string temporary_path = makeTemporaryPath();
+	if (
+		!cloneOrCopyFile(output_path, temporary_path, 0444)
+		|| rename(temporary_path.c_str(), cached_output.c_str()) != 0
+	) {
+		unlink(temporary_path.c_str());
+		return;
+	}
+	commitEntry(key, deps);
+}
+
+void OutputCache::storeText(
+	const string& key, const vector<string>& included_files, const vector<string>& missing_files,
+	const string& output
+) {
+	string deps;
+	string cached_output = prepareEntry(key, included_files, missing_files, deps);
+	if (cached_output.empty()) {
+		return;
+	}
+	string temporary_path = makeTemporaryPath();
+	ofstream output_stream(temporary_path, ios::out | ios::trunc | ios::binary);
+	output_stream << output;
+	output_stream.close();
+	if (
+		output_stream.fail()
+		|| chmod(temporary_path.c_str(), 0444) != 0
+		|| rename(temporary_path.c_str(), cached_output.c_str()) != 0
+	) {
+		unlink(temporary_path.c_str());
+		return;
+	}
+	commitEntry(key, deps);
+}
+
+/**
+ * Removes the least recently used files until the cache is comfortably under
+ * max_size, so that it doesn't have to happen again on the very next run.
+ */
+void OutputCache::evict() {
+	struct CacheFile {
+		string path;
+		uint64_t size;
+		time_t last_used;
+	};
+	vector<CacheFile> files;
+	uint64_t total_size = 0;
+
+	DIR* cache_dir = opendir(dir.c_str());
+	if (!cache_dir) {
+		return;
+	}
+	while (struct dirent* entry = readdir(cache_dir)) {
+		string name = entry->d_name;
+		bool is_cache_file =
+			(name.size() > 3 && name.compare(name.size() - 3, 3, ".vv") == 0)
+			|| (name.size() > 5 && name.compare(name.size() - 5, 5, ".deps") == 0)
+			|| name.compare(0, 4, "tmp.") == 0;
+		struct stat file_stat;
+		string path = dir + "/" + name;
+		if (is_cache_file && stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+			files.push_back(CacheFile{path, static_cast<uint64_t>(file_stat.st_size), file_stat.st_mtime});
+			total_size += file_stat.st_size;
+		}
+	}
+	closedir(cache_dir);
+
+	if (total_size <= max_size) {
+		return;
+	}
+	std::sort(files.begin(), files.end(), [](const CacheFile& lhs, const CacheFile& rhs) {
+		return lhs.last_used < rhs.last_used;
+	});
+	uint64_t target_size = max_size / 10 * 9;
+	for (const CacheFile& file : files) {
+		if (total_size <= target_size) {
+			break;
+		}
+		if (unlink(file.path.c_str()) == 0) {
+			total_size -= file.size;
+			++num_evicted;
+		}
+	}
+}
+
+void OutputCache::printStats(ostream& os) {
+	os
+		<< "cache: " << num_hits << " hits, " << num_misses << " misses, "
+		<< num_stores << " stored, " << num_evicted << " files evicted\n";
+}
+
+string OutputCache::makeTemporaryPath() {
+	ostringstream path;
+	path << dir << "/tmp." << getpid() << "." << next_temporary_id++;
+	return path.str();
+}
+
+string OutputCache::hashBytes(const char* data, size_t size) {
+	ContentHash hash;
+	hash.update(data, size);
+	return hash.hexDigest();
+}
+
+string OutputCache::hashFile(const string& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		return "";
+	}
+	ContentHash hash;
+	vector<char> buffer(1024 * 1024);
+	while (true) {
+		ssize_t num_read = read(fd, buffer.data(), buffer.size());
+		if (num_read == -1 && errno == EINTR) {
+			continue;
+		} else if (num_read < 0) {
+			::close(fd);
+			return "";
+		} else if (num_read == 0) {
+			break;
+		}
+		hash.update(buffer.data(), num_read);
+	}
+	::close(fd);
+	return hash.hexDigest();
 }
 
 class IfdefState {
@@ -121,6 +1843,7 @@ public:
 	bool getInDisabledIfdefBlock() { return in_disabled_ifdef_block; }
 	bool foundGoodBranchAlready() { return found_good_branch.top(); }
 	void setFoundGoodBranch(bool b) { found_good_branch.pop(); found_good_branch.push(b); }
+	size_t getDepth() { return found_good_branch.size(); }
 private:
 	bool in_disabled_ifdef_block;
 	std::stack<bool> found_good_branch;
@@ -128,14 +1851,88 @@ private:
 	IfdefState& operator=(const IfdefState&) = delete;
 };
 
-void macro_expansion_pass(istream& is, ostream& os, const vector<string>& predef_macros) {
+const size_t max_include_depth = 200;
+const size_t max_macro_expansion_depth = 200;
+// the characters that can end a macro name
+const char* const macro_name_terminators = ":;-+/*%){}[] (\n\t,`'\"=<>!&|^~?";
+
+/**
+ * Thrown when a header being parsed on its own for the HeaderCache turns out to
+ * depend on where it's included from.
+ */
+struct ContextDependentHeader { };
+
+/**
+ * The state of the macro expansion pass. `include'd files are expanded by the same
+ * MacroExpander, so they share its macros and ifdef state. An isolated MacroExpander
+ * is for parsing a header on its own, and throws ContextDependentHeader where a
+ * normal one would need something from outside of the header.
+ */
+class MacroExpander {
+public:
+	MacroExpander(HeaderCache& headers, size_t include_depth, bool isolated, PassStats& stats);
+	void expand(istream& is, ostream& os, const string& file_dir);
+	/// the macros defined so far, not counting predefined ones
+	vector<Macro> getDefinedMacros();
+	size_t getIfdefDepth() { return ifdef_state.getDepth(); }
+	/// every file `include'd so far, directly or not
+	const vector<string>& getIncludedFiles() { return included_files; }
+	/// everywhere an `include'd file was looked for before where it was found
+	const vector<string>& getMissingFiles() { return missing_files; }
+private:
+	void include(const string& file_name, ostream& os, const string& file_dir);
+	bool expandMacro(const Macro& m, const vector<string>& args, ostream& os, size_t depth);
+	bool expandMacroUses(const string& text, ostream& os, size_t depth);
+	void insertMacro(const Macro& m);
+	void recordInclude(const string& path);
+	void recordMissing(const string& path);
+	void checkInIfdef(const string& directive);
+
+	HeaderCache& headers;
+	size_t include_depth;
+	bool isolated;
 	unordered_map<string,Macro> name2macro;
-	for (const string& predef_macro_name : predef_macros) {
+	vector<string> defined_names;
+	vector<string> included_files;
+	vector<string> missing_files;
+	IfdefState ifdef_state;
+	// full expansions of parameterless macros that use other macros
+	unordered_map<string,string> name2expansion;
+	// the values of the macros that are just a constant, for GENDEFINE ranges
+	ConstantEvaluator constants;
+	PassStats& stats;
+	MacroExpander(const MacroExpander&) = delete;
+	MacroExpander& operator=(const MacroExpander&) = delete;
+};
+
+void macro_expansion_pass(istream& is, ostream& os, HeaderCache& headers, SourceFile& source, PassStats& stats) {
+	for (const string& predef_macro_name : headers.getPredefMacros()) {
+		os << "`define " << predef_macro_name << "\n";
+	}
+	MacroExpander expander(headers, 0, false, stats);
+	expander.expand(is, os, source.dir);
+	source.included_files = expander.getIncludedFiles();
+	source.missing_files = expander.getMissingFiles();
+}
+
+MacroExpander::MacroExpander(HeaderCache& headers_, size_t include_depth_, bool isolated_, PassStats& stats_)
+	: headers(headers_)
+	, include_depth(include_depth_)
+	, isolated(isolated_)
+	, name2macro()
+	, defined_names()
+	, included_files()
+	, missing_files()
+	, ifdef_state()
+	, name2expansion()
+	, constants(Caret::POWER)
+	, stats(stats_) {
+	for (const string& predef_macro_name : headers.getPredefMacros()) {
 		name2macro.insert(make_pair(predef_macro_name, Macro(predef_macro_name, {}, "")));
-		os << "`define " << predef_macro_name << "\n";
 	}
-	IfdefState ifdef_state{};
+}
 
+void MacroExpander::expand(istream& is, ostream& os, const string& file_dir) {
 	char prev_char = '\0';
 	while (true) {
 		int c = is.get();
@@ -143,33 +1940,35 @@ void macro_expansion_pass(istream& is, ostream& os, const vector<string>& predef
 			break;
 		}
 
-		string comment_line = skipToNextLineIfComment(prev_char,c,is);
-		if (comment_line.size() > 0) {
+		string comment_line;
+		if (readCommentOrString(prev_char,c,is,comment_line)) {
 			if (!ifdef_state.getInDisabledIfdefBlock()) {
 				os << (char)c << comment_line;
 			}
-			c = is.get();
 			string gendefine_flag = "%%GENDEFINE%%";
-			if (comment_line.compare(0,gendefine_flag.size(),gendefine_flag) == 0) {
-				string generated_define = generate_define(
-					comment_line.substr(gendefine_flag.size())
-				);
-				istringstream generated_define_ss(generated_define);
-				Macro m(generated_define_ss);
-				name2macro.insert(make_pair(m.getName(),m));
-				// cerr << "\n`define " << generated_define;
-				// cerr << "generated `" << m.getName() << "'\n";
+			if (c == '/' && comment_line.compare(0,gendefine_flag.size(),gendefine_flag) == 0) {
+				string gendefine_params = comment_line.substr(gendefine_flag.size());
+				if (isolated) {
+					try {
+						insertMacro(generate_define(gendefine_params, constants));
+					} catch (const PreprocessorError&) {
+						// might use a macro from outside; the real parse will say if not
+						throw ContextDependentHeader();
+					}
+				} else {
+					insertMacro(generate_define(gendefine_params, constants));
+				}
+				++stats.gendefines_generated;
 			}
-		}
-		if (is.eof()) {
-			break;
+			prev_char = (c == '"') ? '"' : ' ';
+			continue;
 		}
 
 		if (c == '`') {
-			string directive = trim(readUntil(is, ":;-+/*%){}[] (\n", true)); // arg.. regexes
+			string directive = trim(readUntil(is, macro_name_terminators, true)); // arg.. regexes
 			if (directive == "define" && !ifdef_state.getInDisabledIfdefBlock()) {
 				Macro m(is);
-				name2macro.insert(make_pair(m.getName(),m));
+				insertMacro(m);
 				if (m.isEmptyMacro()) {
 					os << "`define " << m.getName() << '\n';
 				}
@@ -181,19 +1980,28 @@ void macro_expansion_pass(istream& is, ostream& os, const vector<string>& predef
 					ifdef_state.setFoundGoodBranch(true);
 					ifdef_state.setInDisabledIfdefBlock(false);
 				} else {
+					if (isolated) {
+						throw ContextDependentHeader();
+					}
 					ifdef_state.setInDisabledIfdefBlock(true);
 				}
 			} else if (directive == "elseif") {
+				checkInIfdef(directive);
 				string test_name = trim(readUntil(is," \n",true));
+				bool is_defined = name2macro.find(test_name) != name2macro.end();
+				if (isolated && !is_defined) {
+					throw ContextDependentHeader();
+				}
 				if (
 					! ifdef_state.foundGoodBranchAlready()
-					&& name2macro.find(test_name) != name2macro.end()) {
+					&& is_defined) {
 					ifdef_state.setInDisabledIfdefBlock(false);
 					ifdef_state.setFoundGoodBranch(true);
 				} else {
 					ifdef_state.setInDisabledIfdefBlock(true);
 				}
 			} else if (directive == "else") {
+				checkInIfdef(directive);
 				if (ifdef_state.foundGoodBranchAlready()) {
 					ifdef_state.setInDisabledIfdefBlock(true);
 				} else {
@@ -201,28 +2009,47 @@ void macro_expansion_pass(istream& is, ostream& os, const vector<string>& predef
 					ifdef_state.setFoundGoodBranch(true);
 				}
 			} else if (directive == "endif") {
+				checkInIfdef(directive);
 				ifdef_state.exitIfdef();
+			} else if (directive == "include") {
+				char open_quote = '\0';
+				is >> open_quote;
+				if (open_quote != '"' && open_quote != '<') {
+					throw PreprocessorError("expected a quoted file name after `include");
+				}
+				char close_quote = (open_quote == '"') ? '"' : '>';
+				string file_name = readUntil(is, close_quote == '"' ? "\"\n" : ">\n", false);
+				if (is.get() != close_quote) {
+					throw PreprocessorError("unterminated file name after `include " + string(1,open_quote) + file_name);
+				}
+				if (!ifdef_state.getInDisabledIfdefBlock()) {
+					include(file_name, os, file_dir);
+				}
 			} else if (!ifdef_state.getInDisabledIfdefBlock()) {
 				auto lookup_result = name2macro.find(directive);
 				if (lookup_result == name2macro.end()) {
+					if (isolated) {
+						throw ContextDependentHeader();
+					}
 					// string lines = readUntil(is,"\n",false);
 					// lines += is.get();
 					// lines += readUntil(is,"\n",false);
 					// lines += is.get();
 					// lines += readUntil(is,"\n",false);
 					// lines += is.get();
-					cerr
-						<< "macro \""<<directive<<"\" has not been defined\n"
-						// << "near " << lines << "\n"
+					ostringstream message;
+					message
+						<< "macro \""<<directive<<"\" has not been defined"
+						// << "near " << lines
 						;
-					exit(1);
+					throw PreprocessorError(message.str());
 				} else {
 					vector<string> param_list;
 					if (is.peek() == '(') {
 						param_list = parseParamList(is);
 					} // leave empty in other cases
 
-					os << lookup_result->second.expand(param_list);
+					expandMacro(lookup_result->second, param_list, os, 0);
 				}
 			}
 		} else if (!ifdef_state.getInDisabledIfdefBlock()) {
@@ -232,419 +2059,906 @@ void macro_expansion_pass(istream& is, ostream& os, const vector<string>& predef
 	}
 }
 
-void module_redeclaration_pass(istream& is, ostream& os) {
-	int prev_char = ' ';
-	while (true) {
-		int c = is.get();
-		if (is.eof()) {
+void MacroExpander::include(const string& file_name, ostream& os, const string& file_dir) {
+	vector<string> missing_here;
+	string path = headers.resolve(file_name, file_dir, missing_here);
+	for (const string& missing_file : missing_here) {
+		recordMissing(missing_file);
+	}
+	if (path.empty()) {
+		throw PreprocessorError("couldn't find `include'd file \"" + file_name + "\"");
+	}
+	if (include_depth >= max_include_depth) {
+		throw PreprocessorError("`include's nested too deeply, at \"" + path + "\"");
+	}
+
+	recordInclude(path);
+	shared_ptr<const HeaderCache::ParsedHeader> header = headers.get(path, include_depth + 1);
+	bool can_use_cached = header->context_independent;
+	for (const Macro& m : header->macros) {
+		if (!can_use_cached) {
 			break;
 		}
+		// the existing definition would win, which the cached text doesn't know about
+		can_use_cached = name2macro.find(m.getName()) == name2macro.end();
+	}
 
-		string comment_line = skipToNextLineIfComment(prev_char,c,is);
-		if (comment_line.size() > 0) {
-			os.put(c);
-			c = is.get();
-			os << comment_line;
+	if (can_use_cached) {
+		os << header->text;
+		for (const Macro& m : header->macros) {
+			insertMacro(m);
+		}
+		for (const string& included_file : header->included_files) {
+			recordInclude(included_file);
+		}
+		for (const string& missing_file : header->missing_files) {
+			recordMissing(missing_file);
+		}
+	} else {
+		ifstream header_stream(path);
+		if (!header_stream) {
+			throw PreprocessorError("couldn't open `include'd file \"" + path + "\"");
+		}
+		++include_depth;
+		expand(header_stream, os, directoryOf(path));
+		--include_depth;
+	}
+}
+
+/**
+ * Expands m, and then any macros used in what it expanded to, up to
+ * max_macro_expansion_depth deep. Returns false if some of those macros weren't
+ * defined (and so were left as is).
+ */
+bool MacroExpander::expandMacro(const Macro& m, const vector<string>& args, ostream& os, size_t depth) {
+	++stats.macro_expansions;
+	bool args_have_macro_uses = false;
+	for (const string& arg : args) {
+		args_have_macro_uses = args_have_macro_uses || arg.find('`') != string::npos;
+	}
+	if (!m.hasMacroUses() && !args_have_macro_uses) {
+		m.expand(args, os);
+		return true;
+	}
+
+	bool cacheable = m.getNumParams() == 0 && args.empty();
+	if (cacheable) {
+		auto cached = name2expansion.find(m.getName());
+		if (cached != name2expansion.end()) {
+			os << cached->second;
+			return true;
 		}
+	}
+
+	if (depth >= max_macro_expansion_depth) {
+		throw PreprocessorError(
+			"macro \"" + m.getName() + "\" nested too deeply (does it end up using itself?)");
+	}
+
+	ostringstream substituted;
+	m.expand(args, substituted);
+	if (!cacheable) {
+		return expandMacroUses(substituted.str(), os, depth + 1);
+	}
+
+	ostringstream expanded;
+	bool fully_expanded = expandMacroUses(substituted.str(), expanded, depth + 1);
+	if (fully_expanded) {
+		// definitions never change, so this is good for the rest of the file
+		name2expansion.insert(make_pair(m.getName(), expanded.str()));
+	}
+	os << expanded.str();
+	return fully_expanded;
+}
+
+bool MacroExpander::expandMacroUses(const string& text, ostream& os, size_t depth) {
+	bool fully_expanded = true;
+	istringstream is(text);
+	while (true) {
+		int c = is.get();
 		if (is.eof()) {
 			break;
 		}
+		if (c != '`') {
+			os.put(c);
+			continue;
+		}
 
-		if (c == 'm' && isspace(prev_char)) {
-			is.putback(c);
-			string module_token;
-			is >> module_token;
-			os << module_token;
-			if (module_token == "module") {
-				string module_name = readUntil(is, "(", false);
-				os << module_name;
-				vector<string> module_params = parseParamList(is);
-				vector<string> module_param_names;
-				vector<string> module_param_types;
-
-				os << '(';
-
-				bool needs_redecl = false;
-				for (auto& param : module_params) {
-					if (param.find("input ") == 0 || param.find("output ") == 0) {
-						needs_redecl = true;
-						break;
-					}
-				}
+		string use_name = readUntil(is, macro_name_terminators, false);
+		auto lookup_result = name2macro.find(use_name);
+		if (lookup_result == name2macro.end()) {
+			if (isolated) {
+				throw ContextDependentHeader();
+			}
+			// could be anything; leave it for whatever reads the output
+			os << '`' << use_name;
+			fully_expanded = false;
+			continue;
+		}
 
-				for (auto param = module_params.begin(); param != module_params.end(); ++param) {
-					string::size_type last_space_index = param->find_last_of(" ");
-					// (NOTE: whitespace is trimmed in parseParamList)
-					if (needs_redecl) {
-						string name = param->substr(last_space_index);
-						os << name;
-						module_param_names.push_back(name);
-						module_param_types.push_back(param->substr(0, last_space_index));
-					} else {
-						os << *param;
-					}
-					if ((param + 1) != module_params.end()) {
-						os << ",\n";
-					}
+		vector<string> param_list;
+		if (is.peek() == '(') {
+			param_list = parseParamList(is);
+		}
+		fully_expanded = expandMacro(lookup_result->second, param_list, os, depth) && fully_expanded;
+	}
+	return fully_expanded;
+}
 
-				}
+void MacroExpander::insertMacro(const Macro& m) {
+	if (name2macro.insert(make_pair(m.getName(),m)).second) {
+		defined_names.push_back(m.getName());
+		long value = 0;
+		if (m.getNumParams() == 0 && constants.evaluate(m.getBody(), value)) {
+			constants.defineSymbol(m.getName(), value);
+		}
+	}
+}
 
-				os << ')';
+void MacroExpander::recordInclude(const string& path) {
+	if (std::find(included_files.begin(), included_files.end(), path) == included_files.end()) {
+		included_files.push_back(path);
+	}
+}
 
-				{
-					string rest_of_decl = readUntil(is,";",false);
-					os << rest_of_decl << (char)is.get() << '\n';
-				}
+void MacroExpander::recordMissing(const string& path) {
+	if (std::find(missing_files.begin(), missing_files.end(), path) == missing_files.end()) {
+		missing_files.push_back(path);
+	}
+}
 
-				if (needs_redecl) {
-					for (size_t i = 0; i < module_params.size(); ++i) {
-						string::size_type position_of_reg = string::npos;
-						string::size_type position_of_wire = string::npos;
-						if (module_param_types[i].find("output") != string::npos
-							&& (position_of_reg = module_param_types[i].find("reg")) != string::npos) {
-							// the case of an output reg
-							string rest_of_type = module_param_types[i].substr(position_of_reg + 3);
-							os << "output" << rest_of_type << module_param_names[i] << ";\n";
-							os << "reg   " << rest_of_type << module_param_names[i] << ";\n";
-
-						} else {
-							os << module_params[i] << ";\n";
-						}
-					}
-				}
-			}
-		} else {
-			os.put(c);
+void MacroExpander::checkInIfdef(const string& directive) {
+	if (ifdef_state.getDepth() == 0) {
+		if (isolated) {
+			throw ContextDependentHeader();
 		}
-		prev_char = c;
+		throw PreprocessorError("`" + directive + " without a matching `ifdef");
 	}
 }
 
-void twodim_reduction_pass_redecl(
-	istream& is, ostream& os, unordered_map<string,WireInfo>& name2size);
-void twodim_reduction_pass_rewrite(
-	istream& is, ostream& os, unordered_map<string,WireInfo>& name2size);
+vector<Macro> MacroExpander::getDefinedMacros() {
+	vector<Macro> result;
+	for (const string& name : defined_names) {
+		result.push_back(name2macro.at(name));
+	}
+	return result;
+}
 
-void twodim_reduction_pass(istream& is, ostream& os) {
-	unordered_map<string,WireInfo> name2size;
-	stringstream with_redecl;
-	twodim_reduction_pass_redecl(is, with_redecl, name2size);
-	twodim_reduction_pass_rewrite(with_redecl, os, name2size);
+HeaderCache::HeaderCache(const vector<string>& predef_macros_, const vector<string>& include_paths_)
+	: predef_macros(predef_macros_)
+	, include_paths()
+	, path2header_mutex()
+	, path2header() {
+	for (const string& include_path : include_paths_) {
+		include_paths.push_back(canonicalPath(include_path));
+	}
 }
 
-void twodim_reduction_pass_redecl(
-	istream& is, ostream& os, unordered_map<string,WireInfo>& name2size) {
-	int prev_char = ' ';
-	while (true) {
-		int c = is.get();
-		if (is.eof()) {
-			break;
+string HeaderCache::resolve(const string& file_name, const string& including_dir, vector<string>& missing_files) {
+	vector<string> candidates;
+	if (!file_name.empty() && file_name[0] == '/') {
+		candidates.push_back(file_name);
+	} else {
+		// canonical, so that the missing ones mean the same from anywhere
+		candidates.push_back(canonicalPath(including_dir) + "/" + file_name);
+		for (const string& include_path : include_paths) {
+			candidates.push_back(include_path + "/" + file_name);
 		}
+	}
 
-		string comment_line = skipToNextLineIfComment(prev_char,c,is);
-		if (comment_line.size() > 0) {
-			os.put(c);
-			c = is.get();
-			os << comment_line;
+	for (const string& candidate : candidates) {
+		if (!isRegularFile(candidate)) {
+			missing_files.push_back(candidate);
+			continue;
 		}
-		if (is.eof()) {
-			break;
+		char* real_path = realpath(candidate.c_str(), nullptr);
+		if (real_path) {
+			string result(real_path);
+			free(real_path);
+			return result;
 		}
+	}
+	return "";
+}
 
-		if ((c == 'r' || c == 'w') && isspace(prev_char)) {
-			is.putback(c);
-			string decl;
-			is >> decl;
-			if (decl == "reg" || decl == "wire") {
-				decl += readUntil(is, ";", false);
-				trim(decl);
-				bool success = false;
-				WireInfo wire_info;
-				std::tie(success,wire_info) = WireInfo::parseWire(decl);
-				if (success && wire_info.getNumDimensions() > 1) {
-					is.get(); // consume ';'
-					name2size.insert(std::make_pair(wire_info.getName(),wire_info));
-					os << wire_info.makeDeclaration();
-				} else {
-					os << decl;
-				}
-			} else {
-				os << decl;
-			}
-		} else {
-			os.put(c);
+shared_ptr<const HeaderCache::ParsedHeader> HeaderCache::get(const string& path, size_t include_depth) {
+	{
+		std::lock_guard<std::mutex> lock(path2header_mutex);
+		auto found = path2header.find(path);
+		if (found != path2header.end()) {
+			return found->second;
 		}
-		prev_char = c;
 	}
 
-	// cerr << "found twodims:\n";
-	// for (auto twodim = name2size.begin(); twodim != name2size.end(); ++twodim) {
-	// 	cerr << "name="<<twodim->first<<" range="<<twodim->second.first<<"-"<<twodim->second.second<<"\n";
-	// }
-}
+	// Parse without holding the lock, as the header may include others. Two threads
+	// may end up parsing the same header, but only the first result is kept.
+	ifstream header_stream(path);
+	if (!header_stream) {
+		throw PreprocessorError("couldn't open `include'd file \"" + path + "\"");
+	}
+	auto header = make_shared<ParsedHeader>();
+	try {
+		// an isolated parse's work is shared by every file that includes it, so isn't counted
+		PassStats unused_stats = PassStats();
+		MacroExpander expander(*this, include_depth, true, unused_stats);
+		ostringstream text;
+		expander.expand(header_stream, text, directoryOf(path));
+		if (expander.getIfdefDepth() != 0) {
+			throw ContextDependentHeader();
+		}
+		header->text = text.str();
+		header->macros = expander.getDefinedMacros();
+		header->included_files = expander.getIncludedFiles();
+		header->missing_files = expander.getMissingFiles();
+	} catch (const ContextDependentHeader&) {
+		header->context_independent = false;
+		header->text.clear();
+		header->macros.clear();
+	}
 
-void twodim_reduction_pass_rewrite(
-	istream& is,
-	ostream& os,
-	unordered_map<string,WireInfo>& name2size
-) {
+	std::lock_guard<std::mutex> lock(path2header_mutex);
+	return path2header.insert(make_pair(path, header)).first->second;
+}
 
-	unordered_multimap<size_t,string> length2name;
-	size_t longest_name = 2;
+const char* const keyword_names[] = {
+	"module", "endmodule", "reg", "wire", "parameter", "localparam", "signed", "input", "output",
+};
+const size_t num_keywords = sizeof(keyword_names) / sizeof(keyword_names[0]);
 
-	for (const auto& name_and_size : name2size) {
-		length2name.insert(make_pair(name_and_size.first.size(),name_and_size.first));
-		if (name_and_size.first.size() > longest_name) {
-			longest_name = name_and_size.first.size();
+Symbol findKeyword(const char* text, size_t size) {
+	for (size_t keyword = 0; keyword < num_keywords; ++keyword) {
+		const char* name = keyword_names[keyword];
+		if (name[0] == text[0] && strlen(name) == size && std::equal(text, text + size, name)) {
+			return static_cast<Symbol>(keyword);
 		}
 	}
+	return no_symbol;
+}
 
-	deque<char> last_few_chars;
-	bool flush_buffer = false;
+/*
+ * A token's code is a byte with its kind in the low 3 bits, and a number in the
+ * high 5: its size, or for a keyword or placeholder, its symbol. A number that
+ * doesn't fit in 5 bits follows the byte, 7 bits at a time, low bits first.
+ */
+const unsigned char token_code_keyword = 6; // a WORD that's a keyword
+const unsigned char token_code_kind_mask = 0x7;
+const unsigned char token_code_number_shift = 3;
+const uint64_t token_code_number_follows = 31;
+
+void TokenChunk::appendCode(const Token& token) {
+	unsigned char kind = static_cast<unsigned char>(token.kind);
+	uint64_t number = token.size;
+	if (token.kind == TokenKind::PLACEHOLDER) {
+		number = token.symbol;
+	} else if (token.kind == TokenKind::WORD && token.symbol != no_symbol) {
+		kind = token_code_keyword;
+		number = token.symbol;
+	}
 
-	while (true) {
-		while (last_few_chars.size() < longest_name) {
-			last_few_chars.push_back(is.get());
-			if (is.eof()) {
-				last_few_chars.pop_back();
+	last_code = codes.size();
+	if (number < token_code_number_follows) {
+		codes.push_back(static_cast<unsigned char>(kind | (number << token_code_number_shift)));
+		return;
+	}
+	codes.push_back(static_cast<unsigned char>(kind | (token_code_number_follows << token_code_number_shift)));
+	while (number >= 0x80) {
+		codes.push_back(static_cast<unsigned char>(0x80 | (number & 0x7f)));
+		number >>= 7;
+	}
+	codes.push_back(static_cast<unsigned char>(number));
+}
+
+void TokenChunk::append(const Token& token) {
+	text.insert(text.end(), token.text, token.text + token.size);
+	appendCode(token);
+}
+
+void TokenChunk::extendLast(const Token& token) {
+	size_t code_pos = last_code;
+	size_t text_pos = 0;
+	Token last;
+	decode(code_pos, text_pos, last);
+	codes.resize(last_code);
+	text.insert(text.end(), token.text, token.text + token.size);
+	last.size += token.size;
+	last.text = text.data() + text.size() - last.size;
+	if (last.kind == TokenKind::WORD) {
+		last.symbol = findKeyword(last.text, last.size);
+	}
+	appendCode(last);
+}
+
+void TokenChunk::decode(size_t& code_pos, size_t& text_pos, Token& token) const {
+	unsigned char code = codes[code_pos++];
+	uint64_t number = code >> token_code_number_shift;
+	if (number == token_code_number_follows) {
+		number = 0;
+		for (unsigned shift = 0; ; shift += 7) {
+			unsigned char more = codes[code_pos++];
+			number |= static_cast<uint64_t>(more & 0x7f) << shift;
+			if ((more & 0x80) == 0) {
 				break;
 			}
 		}
+	}
+
+	unsigned char kind = code & token_code_kind_mask;
+	token.text = text.data() + text_pos;
+	if (kind == token_code_keyword) {
+		token.kind = TokenKind::WORD;
+		token.symbol = static_cast<Symbol>(number);
+		token.size = strlen(keyword_names[number]);
+	} else if (kind == static_cast<unsigned char>(TokenKind::PLACEHOLDER)) {
+		token.kind = TokenKind::PLACEHOLDER;
+		token.symbol = static_cast<Symbol>(number);
+		token.size = 0;
+	} else {
+		token.kind = static_cast<TokenKind>(kind);
+		token.symbol = no_symbol;
+		token.size = number;
+	}
+	text_pos += token.size;
+}
+
+const size_t SymbolTable::no_name = static_cast<size_t>(-1);
+
+SymbolTable::SymbolTable()
+	: slots(16, Slot{0, no_name, 0, no_symbol})
+	, num_symbols(0)
+	, names() {
+
+}
+
+Symbol SymbolTable::find(const char* text, size_t size) const {
+	uint64_t hash = hashWord(text, size);
+	size_t mask = slots.size() - 1;
+	for (size_t index = hash & mask; slots[index].name != no_name; index = (index + 1) & mask) {
+		const Slot& slot = slots[index];
+		if (slot.hash == hash && slot.size == size && std::equal(text, text + size, names.data() + slot.name)) {
+			return slot.symbol;
+		}
+	}
+	return no_symbol;
+}
 
-		if (!is.eof()) {
-			string comment_line = skipToNextLineIfComment(last_few_chars[0],last_few_chars[1],is);
-			if (comment_line.size() > 0) {
-				for (char c : comment_line) {
-					last_few_chars.push_back(c);
+Symbol SymbolTable::intern(const string& word) {
+	Symbol found = find(word.data(), word.size());
+	if (found != no_symbol) {
+		return found;
+	}
+
+	if (2 * (num_symbols + 1) > slots.size()) {
+		vector<Slot> old_slots(2 * slots.size(), Slot{0, no_name, 0, no_symbol});
+		old_slots.swap(slots);
+		for (const Slot& slot : old_slots) {
+			if (slot.name != no_name) {
+				size_t index = slot.hash & (slots.size() - 1);
+				while (slots[index].name != no_name) {
+					index = (index + 1) & (slots.size() - 1);
 				}
-				flush_buffer = true;
-				goto continue_and_ouput;
+				slots[index] = slot;
 			}
 		}
+	}
 
-		if (is.eof()) {
-			// flush buffer & exit
-			while (!last_few_chars.empty()) {
-				os.put(last_few_chars.front());
-				last_few_chars.pop_front();
-			}
-			break;
+	uint64_t hash = hashWord(word.data(), word.size());
+	size_t index = hash & (slots.size() - 1);
+	while (slots[index].name != no_name) {
+		index = (index + 1) & (slots.size() - 1);
+	}
+	slots[index] = Slot{hash, names.size(), word.size(), static_cast<Symbol>(num_symbols)};
+	names += word;
+	return static_cast<Symbol>(num_symbols++);
+}
+
+/// FNV-1a
+uint64_t SymbolTable::hashWord(const char* text, size_t size) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ static_cast<unsigned char>(text[i])) * 1099511628211ull;
+	}
+	return hash;
+}
+
+TokenReader::TokenReader(TokenSource& source_)
+	: source(source_)
+	, chunks()
+	, first_chunk_number(0)
+	, decode_chunk(0)
+	, code_pos(0)
+	, text_pos(0)
+	, decoded()
+	, current()
+	, source_done(false)
+	, num_bytes_read(0) {
+
+}
+
+TokenReader::~TokenReader() {
+	// so that a pass that stops early doesn't leave the one before it stuck on a full queue
+	TokenChunk chunk;
+	while (!source_done && source.pop(chunk)) { }
+}
+
+const Token* TokenReader::peek(size_t ahead) {
+	while (decoded.size() <= ahead) {
+		if (!decodeNext()) {
+			return nullptr;
+		}
+	}
+	return &decoded[ahead].token;
+}
+
+const Token& TokenReader::get() {
+	if (!peek()) {
+		throw std::logic_error("TokenReader::get() past the end");
+	}
+	current = decoded.front().token;
+	uint64_t chunk_number = decoded.front().chunk_number;
+	decoded.pop_front();
+	// what's left to decode, or has been, is from this chunk on
+	while (first_chunk_number < chunk_number) {
+		chunks.pop_front();
+		++first_chunk_number;
+		--decode_chunk;
+	}
+	num_bytes_read += current.size;
+	return current;
+}
+
+bool TokenReader::decodeNext() {
+	while (decode_chunk == chunks.size() || code_pos == chunks[decode_chunk].codes.size()) {
+		if (decode_chunk < chunks.size()) {
+			++decode_chunk;
+			code_pos = 0;
+			text_pos = 0;
+			continue;
+		}
+		if (source_done) {
+			return false;
 		}
+		chunks.emplace_back();
+		if (!source.pop(chunks.back())) {
+			chunks.pop_back();
+			source_done = true;
+			return false;
+		}
+	}
+	DecodedToken next;
+	chunks[decode_chunk].decode(code_pos, text_pos, next.token);
+	next.chunk_number = first_chunk_number + decode_chunk;
+	decoded.push_back(next);
+	return true;
+}
 
+TokenWriter::TokenWriter(TokenSink& sink_)
+	: sink(sink_)
+	, chunk()
+	, last_kind(TokenKind::PLACEHOLDER)
+	, num_bytes_written(0) {
 
-		// see if the last n chars match a declared twodim (of length n)
-		{
-			string found_match = "";
-			// cerr << "comparing with `" << last_few_chars << "'\n";
-			for (size_t i = 1; i <= longest_name; ++i) { // must iterate from smallest to largest
-				auto range = length2name.equal_range(i);
-				if (range.first != length2name.end()) {
-					// have entries of this size
-					// cerr << "looking at twodims of size "<< i << '\n';
-					for (auto l2name_iter = range.first; l2name_iter != range.second; ++l2name_iter) {
-						string& name = l2name_iter->second;
-						// cerr << "\tlooking at `" << name << "'\n";
-						bool found_divergence = false;
-						auto last_char = last_few_chars.rbegin();
-						for (
-							auto char_in_name = name.rbegin();
-							char_in_name != name.rend() && last_char != last_few_chars.rend();
-							++char_in_name, ++last_char
-						) {
-							if (*char_in_name != *last_char) {
-								found_divergence = true;
-								break;
-							}
-						}
-						if (!found_divergence) {
-							found_match = name;
-							// cerr << name << " matches\n";
-						}
-					}
-				}
+}
+
+void TokenWriter::put(const Token& token) {
+	num_bytes_written += token.size;
+	if (
+		!chunk.codes.empty() && last_kind == token.kind
+		&& (token.kind == TokenKind::WORD || token.kind == TokenKind::SPACE)
+	) {
+		chunk.extendLast(token);
+		return;
+	}
+	if (chunk.getNumBytes() >= stream_chunk_size) {
+		sink.push(std::move(chunk));
+		chunk = TokenChunk();
+	}
+	chunk.append(token);
+	last_kind = token.kind;
+}
+
+void TokenWriter::put(const TokenChunk& tokens) {
+	size_t code_pos = 0;
+	size_t text_pos = 0;
+	Token token;
+	while (code_pos < tokens.codes.size()) {
+		tokens.decode(code_pos, text_pos, token);
+		put(token);
+	}
+}
+
+void TokenWriter::write(const string& text) {
+	lexTokens(text.data(), text.size(), true, [&](const Token& token) { put(token); });
+}
+
+void TokenWriter::putPlaceholder(Symbol number) {
+	put(Token{"", 0, TokenKind::PLACEHOLDER, number});
+}
+
+void TokenWriter::close() {
+	if (!chunk.codes.empty()) {
+		sink.push(std::move(chunk));
+		chunk = TokenChunk();
+	}
+	sink.close();
+}
+
+void module_redeclaration_pass(TokenReader& in, TokenWriter& out) {
+	int prev_char = ' ';
+	while (in.peek()) {
+		const Token& token = in.get();
+		const Token* next = in.peek();
+		if (!token.is(Keyword::MODULE) || !isspace(prev_char) || (next && next->kind != TokenKind::SPACE)) {
+			out.put(token);
+			prev_char = token.lastChar(prev_char);
+			continue;
+		}
+		out.put(token);
+
+		string module_name = readTokensUntil(in, '(');
+		out.write(module_name);
+		if (!in.peek()) {
+			throw PreprocessorError("param list doesn't start with a '(' ( is '')");
+		}
+		in.get(); // consume '('
+		while (in.peek() && in.peek()->kind == TokenKind::SPACE) {
+			in.get();
+		}
+		vector<string> module_params = splitAndTrim(readTokensUntil(in, ')'), ',');
+		if (in.peek()) {
+			in.get(); // consume ')'
+		}
+		vector<string> module_param_names;
+		vector<string> module_param_types;
+
+		ostringstream os;
+		os << '(';
+
+		bool needs_redecl = false;
+		for (auto& param : module_params) {
+			if (param.find("input ") == 0 || param.find("output ") == 0) {
+				needs_redecl = true;
+				break;
 			}
+		}
 
-			// sub in the match
+		for (auto param = module_params.begin(); param != module_params.end(); ++param) {
+			string::size_type last_space_index = param->find_last_of(" ");
+			// (NOTE: whitespace is trimmed by splitAndTrim)
+			if (needs_redecl) {
+				string name = param->substr(last_space_index);
+				os << name;
+				module_param_names.push_back(name);
+				module_param_types.push_back(param->substr(0, last_space_index));
+			} else {
+				os << *param;
+			}
+			if ((param + 1) != module_params.end()) {
+				os << ",\n";
+			}
 
-			if (found_match.size() > 0) {
-				string next_chars;
-				while (isspace(is.peek())) {
-					next_chars += is.get();
-				}
-				if (is.peek() == '[') {
-					is.get(); // consume '['
-					stringstream new_suffix;
-					string inside_brackets = readUntil(is,"]",false);
-					istringstream inside_brackets_ss(inside_brackets);
-					int evaluated_insides;
-					bool good = false;
-					try {
-						evaluated_insides = mathEval(inside_brackets_ss);
-						good = true;
-					} catch (const std::invalid_argument&) {
-					} catch (const std::out_of_range&) {
-					}
+		}
 
-					if (!good) {
-						last_few_chars.push_back('[');
-						for (char c : inside_brackets) {
-							last_few_chars.push_back(c);
-						}
-						flush_buffer = true;
-						goto continue_and_ouput;
-					}
+		os << ')';
+
+		os << readTokensUntil(in, ';');
+		if (in.peek()) {
+			in.get(); // consume ';'
+			os << ';';
+		}
+		os << '\n';
+
+		if (needs_redecl) {
+			for (size_t i = 0; i < module_params.size(); ++i) {
+				string::size_type position_of_reg = string::npos;
+				if (module_param_types[i].find("output") != string::npos
+					&& (position_of_reg = module_param_types[i].find("reg")) != string::npos) {
+					// the case of an output reg
+					string rest_of_type = module_param_types[i].substr(position_of_reg + 3);
+					os << "output" << rest_of_type << module_param_names[i] << ";\n";
+					os << "reg   " << rest_of_type << module_param_names[i] << ";\n";
 
-					new_suffix << "_" << evaluated_insides << next_chars;
-					is.get(); // consume ']';
-					while (true) {
-						char c = new_suffix.get();
-						if (new_suffix.eof()) {break;}
-						last_few_chars.push_back(c);
-					}
-					flush_buffer = true;
 				} else {
-					// didn't find a use. Shove it all back in
-					for (auto next_char = next_chars.rbegin(); next_char != next_chars.rend(); ++next_char) {
-						is.putback(*next_char);
-					}
+					os << module_params[i] << ";\n";
 				}
 			}
 		}
-
-		continue_and_ouput:
-		while (
-			last_few_chars.size() >= longest_name
-			|| (flush_buffer && !last_few_chars.empty())
-		) {
-			os.put(last_few_chars.front());
-			// cerr.put(last_few_chars.front());
-			last_few_chars.pop_front();
-		}
-		flush_buffer = false;
+		out.write(os.str());
+		prev_char = 'm';
 	}
-
 }
 
-vector<std::pair<string,string>> ft_strings_to_find {
-	{" signed ", " "},
-	{"output wire", "output"},
-	{"input wire", "input"},
-	{"'h", "32'h"},
+/// which elements of a twodim are used, when only those are to be declared
+struct TwodimUses {
+	TwodimUses() : all(false), indices() { }
+	bool all; // used with a non-constant index, or as a whole
+	std::set<size_t> indices;
 };
 
-void final_touches_pass(istream& is, ostream& os) {
+void twodim_reduction_pass_redecl(
+	TokenReader& in, TokenWriter& out, SymbolTable& twodim_names, vector<WireInfo>* deferred_decls);
+void twodim_reduction_pass_rewrite(
+	TokenReader& in, TokenWriter& out, const SymbolTable& twodim_names,
+	vector<TwodimUses>* twodim_uses, PassStats& stats);
+void twodim_reduction_pass_declare(TokenReader& in, TokenWriter& out, const vector<string>& declarations);
+
+/**
+ * The rewrite needs to know about every twodim before it starts, so the
+ * redeclared tokens are staged in scratch (in memory, or a temporary file when
+ * streaming).
+ * If rewritten_scratch isn't null, only the elements that are used get declared.
+ * What they are isn't known until the rewrite is done, so the redeclaration leaves
+ * placeholders, and the rewritten tokens are staged again in rewritten_scratch to
+ * have them filled in.
+ */
+void twodim_reduction_pass(
+	TokenReader& in, TokenWriter& out, TokenStore& scratch, TokenStore* rewritten_scratch, PassStats& stats
+) {
+	SymbolTable twodim_names;
+	vector<WireInfo> deferred_decls;
+	{
+		TokenWriter scratch_out(scratch);
+		twodim_reduction_pass_redecl(in, scratch_out, twodim_names, rewritten_scratch ? &deferred_decls : nullptr);
+		scratch_out.close();
+	}
+	stats.twodims_found = twodim_names.size();
+
+	TokenReader scratch_in(scratch);
+	if (!rewritten_scratch) {
+		twodim_reduction_pass_rewrite(scratch_in, out, twodim_names, nullptr, stats);
+		return;
+	}
+
+	vector<TwodimUses> twodim_uses(twodim_names.size());
+	{
+		TokenWriter rewritten_out(*rewritten_scratch);
+		twodim_reduction_pass_rewrite(scratch_in, rewritten_out, twodim_names, &twodim_uses, stats);
+		rewritten_out.close();
+	}
+
+	vector<string> declarations;
+	for (WireInfo& wire_info : deferred_decls) {
+		const string& name = wire_info.getName();
+		const TwodimUses& uses = twodim_uses[twodim_names.find(name.data(), name.size())];
+		if (uses.all) {
+			declarations.push_back(wire_info.makeDeclaration());
+		} else {
+			declarations.push_back(wire_info.makeDeclaration(uses.indices));
+		}
+	}
+	TokenReader rewritten_in(*rewritten_scratch);
+	twodim_reduction_pass_declare(rewritten_in, out, declarations);
+}
+
+void twodim_reduction_pass_redecl(
+	TokenReader& in, TokenWriter& out, SymbolTable& twodim_names, vector<WireInfo>* deferred_decls
+) {
+	ConstantEvaluator constants(Caret::XOR);
+	TokenChunk decl_tokens;
+	int prev_char = ' ';
+	while (in.peek()) {
+		const Token& token = in.get();
+		const Token* next = in.peek();
+		if (
+			(token.is(Keyword::REG) || token.is(Keyword::WIRE)) && isspace(prev_char)
+			&& (!next || next->kind == TokenKind::SPACE)
+		) {
+			decl_tokens = TokenChunk();
+			decl_tokens.append(token);
+			while (in.peek() && !in.peek()->is(';')) {
+				decl_tokens.append(in.get());
+			}
+			string decl(decl_tokens.text.begin(), decl_tokens.text.end());
+			trim(decl);
+			bool success = false;
+			WireInfo wire_info;
+			std::tie(success,wire_info) = WireInfo::parseWire(decl, constants);
+			if (success && wire_info.getNumDimensions() > 1) {
+				if (in.peek()) {
+					in.get(); // consume ';'
+				}
+				twodim_names.intern(wire_info.getName());
+				if (deferred_decls) {
+					out.putPlaceholder(static_cast<Symbol>(deferred_decls->size()));
+					deferred_decls->push_back(wire_info);
+				} else {
+					out.write(wire_info.makeDeclaration());
+				}
+				prev_char = ';';
+			} else {
+				// as trimmed
+				vector<Token> kept;
+				size_t code_pos = 0;
+				size_t text_pos = 0;
+				while (code_pos < decl_tokens.codes.size()) {
+					kept.emplace_back();
+					decl_tokens.decode(code_pos, text_pos, kept.back());
+				}
+				while (kept.back().kind == TokenKind::SPACE) {
+					kept.pop_back();
+				}
+				for (const Token& kept_token : kept) {
+					out.put(kept_token);
+					prev_char = kept_token.lastChar(prev_char);
+				}
+			}
+		} else if (token.is(Keyword::PARAMETER) || token.is(Keyword::LOCALPARAM)) {
+			out.put(token);
+			prev_char = copyParameterDecl(in, out, token.is(Keyword::LOCALPARAM), constants);
+		} else {
+			if (token.is(Keyword::ENDMODULE)) {
+				constants.clearSymbols();
+			}
+			out.put(token);
+			prev_char = token.lastChar(prev_char);
+		}
+	}
+}
 
-	size_t buffer_size = 0;
-	unordered_multimap<size_t,string> length2name;
+bool isIdentifierChar(int c) {
+	return c != EOF && (isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$');
+}
 
-	for (const auto& string_to_find : ft_strings_to_find) {
-		length2name.insert(make_pair(string_to_find.first.size(),string_to_find.first));
-		if (string_to_find.first.size() > buffer_size) {
-			buffer_size = string_to_find.first.size();
+void twodim_reduction_pass_rewrite(
+	TokenReader& in,
+	TokenWriter& out,
+	const SymbolTable& twodim_names,
+	vector<TwodimUses>* twodim_uses,
+	PassStats& stats
+) {
+	ConstantEvaluator constants(Caret::XOR);
+	TokenChunk space; // between a twodim and its '[', if any
+	TokenChunk index_tokens;
+	while (in.peek()) {
+		const Token& token = in.get();
+		if (token.kind != TokenKind::WORD) {
+			out.put(token);
+			continue;
+		}
+		if (token.is(Keyword::PARAMETER) || token.is(Keyword::LOCALPARAM)) {
+			out.put(token);
+			copyParameterDecl(in, out, token.is(Keyword::LOCALPARAM), constants);
+			continue;
+		} else if (token.is(Keyword::ENDMODULE)) {
+			constants.clearSymbols();
+		}
+		out.put(token);
+		Symbol twodim = twodim_names.find(token.text, token.size);
+		if (twodim == no_symbol) {
+			continue;
 		}
-	}
-
-	deque<char> last_few_chars;
-	bool flush_buffer = false;
 
-	while (true) {
-		while (last_few_chars.size() < buffer_size) {
-			last_few_chars.push_back(is.get());
-			if (is.eof()) {
-				last_few_chars.pop_back();
-				break;
+		// sub in the use
+		size_t bracket_ahead = (in.peek() && in.peek()->kind == TokenKind::SPACE) ? 1 : 0;
+		const Token* bracket = in.peek(bracket_ahead);
+		if (!bracket || !bracket->is('[')) {
+			// didn't find a use, so it's the whole thing
+			if (twodim_uses) {
+				(*twodim_uses)[twodim].all = true;
 			}
+			continue;
 		}
 
-		if (!is.eof()) {
-			string comment_line = skipToNextLineIfComment(last_few_chars[0],last_few_chars[1],is);
-			if (comment_line.size() > 0) {
-				for (char c : comment_line) {
-					last_few_chars.push_back(c);
-				}
-				flush_buffer = true;
-				goto continue_and_ouput;
+		space = TokenChunk();
+		index_tokens = TokenChunk();
+		if (bracket_ahead != 0) {
+			space.append(in.get());
+		}
+		index_tokens.append(in.get()); // '['
+		string inside_brackets;
+		while (in.peek() && !in.peek()->is(']')) {
+			const Token& index_token = in.get();
+			index_tokens.append(index_token);
+			inside_brackets.append(index_token.text, index_token.size);
+		}
+		long evaluated_insides = 0;
+		if (in.peek() && constants.evaluate(inside_brackets, evaluated_insides) && evaluated_insides >= 0) {
+			in.get(); // consume ']';
+			++stats.indices_rewritten;
+			if (twodim_uses) {
+				(*twodim_uses)[twodim].indices.insert(evaluated_insides);
 			}
+			out.write("_" + to_string(evaluated_insides));
+			out.put(space);
+		} else {
+			if (twodim_uses) {
+				(*twodim_uses)[twodim].all = true;
+			}
+			// left as it is, and the ']' is copied along with the rest
+			out.put(space);
+			out.put(index_tokens);
 		}
+	}
+}
 
-		if (is.eof()) {
-			// flush buffer & exit
-			while (!last_few_chars.empty()) {
-				os.put(last_few_chars.front());
-				last_few_chars.pop_front();
-			}
-			break;
+/**
+ * Copies in to out, replacing the placeholders left by twodim_reduction_pass_redecl
+ * with declarations.
+ */
+void twodim_reduction_pass_declare(TokenReader& in, TokenWriter& out, const vector<string>& declarations) {
+	while (in.peek()) {
+		const Token& token = in.get();
+		if (token.kind == TokenKind::PLACEHOLDER) {
+			out.write(declarations.at(token.symbol));
+		} else {
+			out.put(token);
 		}
+	}
+}
 
+/// what final_touches_pass hasn't written yet, in case it's part of something to take out
+struct PendingToken {
+	TokenKind kind;
+	Symbol symbol;
+	string text;
+};
 
-		// see if the last n chars match a declared twodim (of length n)
-		{
-			string found_match = "";
-			// cerr << "comparing with `" << last_few_chars << "'\n";
-			for (size_t i = 1; i <= buffer_size; ++i) { // must iterate from smallest to largest
-				auto range = length2name.equal_range(i);
-				if (range.first != length2name.end()) {
-					// have entries of this size
-					// cerr << "looking at twodims of size "<< i << '\n';
-					for (auto l2name_iter = range.first; l2name_iter != range.second; ++l2name_iter) {
-						string& name = l2name_iter->second;
-						// cerr << "\tlooking at `" << name << "'\n";
-						bool found_divergence = false;
-						auto last_char = last_few_chars.rbegin();
-						for (
-							auto char_in_name = name.rbegin();
-							char_in_name != name.rend() && last_char != last_few_chars.rend();
-							++char_in_name, ++last_char
-						) {
-							if (*char_in_name != *last_char) {
-								found_divergence = true;
-								break;
-							}
-						}
-						if (!found_divergence) {
-							found_match = name;
-							// cerr << name << " matches\n";
-						}
-					}
-				}
-			}
-			string output_str = "";
-			if (found_match == " signed ") {
-				output_str = " "; // eat it
-			} else if (found_match == "output wire") {
-				output_str = "output";
-			} else if (found_match == "input wire") {
-				output_str = "input";
+/**
+ * Takes out the `signed' in ` signed ', and the ` wire' in `output wire' and
+ * `input wire'. The writers join up runs of whitespace, so a space is one token.
+ */
+void final_touches_pass(TokenReader& in, ostream& os) {
+	// enough to look back on `output '
+	const size_t holdback_size = 2;
+	deque<PendingToken> pending;
+
+	while (in.peek()) {
+		const Token& token = in.get();
+		const PendingToken* before = pending.empty() ? nullptr : &pending.back();
+		if (token.is(Keyword::SIGNED) && before && before->kind == TokenKind::SPACE && before->text.back() == ' ') {
+			const Token* next = in.peek();
+			if (next && next->kind == TokenKind::SPACE && next->text[0] == ' ') {
+				// ` signed ' becomes ` '
+				const Token& space = in.get();
+				pending.back().text.append(space.text + 1, space.size - 1);
+				continue;
 			}
-			if (output_str.size() > 0) {
-				// cerr << "found: " << found_match << " replacing with: " << output_str << "\n";
-				for (size_t i = 0; i < found_match.size(); ++i) {
-					last_few_chars.pop_back();
-				}
-				for (char c : output_str) {
-					last_few_chars.push_back(c);
-				}
+		} else if (
+			token.is(Keyword::WIRE) && pending.size() >= 2
+			&& before->kind == TokenKind::SPACE && before->text == " "
+		) {
+			const PendingToken& direction = pending[pending.size() - 2];
+			if (
+				direction.kind == TokenKind::WORD
+				&& (direction.symbol == static_cast<Symbol>(Keyword::OUTPUT)
+					|| direction.symbol == static_cast<Symbol>(Keyword::INPUT))
+			) {
+				pending.pop_back();
+				continue;
 			}
 		}
 
-		continue_and_ouput:
-		while (
-			last_few_chars.size() >= buffer_size
-			|| (flush_buffer && !last_few_chars.empty())
-		) {
-			os.put(last_few_chars.front());
-			// cerr.put(last_few_chars.front());
-			last_few_chars.pop_front();
+		pending.push_back(PendingToken{token.kind, token.symbol, token.str()});
+		if (pending.size() > holdback_size) {
+			os << pending.front().text;
+			pending.pop_front();
 		}
-		flush_buffer = false;
+	}
+	for (const PendingToken& pending_token : pending) {
+		os << pending_token.text;
 	}
 }
 
+const size_t Macro::no_param;
+
 Macro::Macro(string name_, const vector<string>& params_, string body_)
 	: is_function_like(params_.size() != 0)
 	, params(params_)
 	, body(body_)
-	, name(name_) {
+	, name(name_)
+	, segments()
+	, has_macro_uses(false)
+	, gendefine{GendefineType::NONE, "", 0, 0, 1} {
+	compile();
+}
+
+Macro::Macro(string name_, const vector<string>& params_, const GendefineSpec& gendefine_)
+	: is_function_like(true)
+	, params(params_)
+	, body()
+	, name(name_)
+	, segments()
+	, has_macro_uses(false)
+	, gendefine(gendefine_) {
 
 }
 
@@ -653,7 +2967,10 @@ Macro::Macro(istream& is)
 	: is_function_like(false)
 	, params()
 	, body()
-	, name() {
+	, name()
+	, segments()
+	, has_macro_uses(false)
+	, gendefine{GendefineType::NONE, "", 0, 0, 1} {
 
 	name = trim(readUntil(is, "\n (", true));
 
@@ -690,6 +3007,7 @@ Macro::Macro(istream& is)
 	}
 
 	trim(body);
+	compile();
 
 	// cerr
 	// <<	"found definition of macro `"<<name<<"'\n"
@@ -701,43 +3019,92 @@ Macro::Macro(istream& is)
 	// cerr <<	"$\nbody = "<<body<<"\n";
 }
 
-string Macro::expand(const vector<string>& args) {
+void Macro::compile() {
+	unordered_map<string,size_t> param2index;
+	for (size_t i = 0; i < params.size(); ++i) {
+		param2index.insert(make_pair(params[i], i));
+	}
+
+	segments.clear();
+	Segment current{"", no_param};
+	for (size_t i = 0; i < body.size(); ) {
+		if (!isIdentifierChar(body[i])) {
+			current.literal += body[i];
+			++i;
+			continue;
+		}
+		size_t identifier_end = i;
+		while (identifier_end < body.size() && isIdentifierChar(body[identifier_end])) {
+			++identifier_end;
+		}
+		string identifier = body.substr(i, identifier_end - i);
+		auto found_param = param2index.find(identifier);
+		if (found_param == param2index.end() || (i > 0 && body[i-1] == '`')) {
+			current.literal += identifier;
+		} else {
+			current.param_index = found_param->second;
+			segments.push_back(current);
+			current = Segment{"", no_param};
+		}
+		i = identifier_end;
+	}
+	if (!current.literal.empty() || segments.empty()) {
+		segments.push_back(current);
+	}
+
+	has_macro_uses = body.find('`') != string::npos;
+}
+
+void Macro::expand(const vector<string>& args, ostream& os) const {
 	if (args.size() != params.size()) {
-		cerr <<
+		ostringstream message;
+		message <<
 			"num given args ("<<args.size()<<") and expected params ("<<params.size()<<")"
-			" differ for macro \""<<name<<"\"\n";
-		exit(1);
+			" differ for macro \""<<name<<"\"";
+		throw PreprocessorError(message.str());
 	}
 
-	string expanded_body = body; // copy the unexpanded body;
+	if (gendefine.type != GendefineType::NONE) {
+		gendefine.write(args, os);
+		return;
+	}
 
-	for (size_t i = 0; i < params.size(); ++i) {
-		size_t pos = 0;
-		while ((pos = expanded_body.find(params[i], pos)) != std::string::npos) {
-			expanded_body.replace(pos, params[i].length(), args[i]);
-			pos += args[i].length();
+	for (const Segment& segment : segments) {
+		os << segment.literal;
+		if (segment.param_index != no_param) {
+			os << args[segment.param_index];
 		}
 	}
-
-	return expanded_body;
 }
 
-string WireInfo::makeDeclaration() {
-	string onedim_base;
-	{
-		ostringstream onedim_builder;
+string WireInfo::makeOnedimBase() {
+	ostringstream onedim_builder;
 
-		onedim_builder << ( (trim(getType()) == "input wire") ? "input" : getType() ) << " [";
+	onedim_builder << ( (trim(getType()) == "input wire") ? "input" : getType() ) << " [";
 
-		if (use_custom_firstdim_decl) {
-			onedim_builder << custom_firstdim_decl;
-		} else {
-			onedim_builder << getUpperBound(1) << ":" << getLowerBound(1);
-		}
-		onedim_builder << "] " << getName();
+	if (use_custom_firstdim_decl) {
+		onedim_builder << custom_firstdim_decl;
+	} else {
+		onedim_builder << getUpperBound(1) << ":" << getLowerBound(1);
+	}
+	onedim_builder << "] " << getName();
+
+	return onedim_builder.str();
+}
 
-		onedim_base = onedim_builder.str();
+string WireInfo::makeDeclaration(const std::set<size_t>& indices) {
+	string onedim_base = makeOnedimBase();
+	ostringstream builder;
+	for (size_t i : indices) {
+		if (i >= getLowerBound(2) && i <= getUpperBound(2)) {
+			builder << onedim_base << "_" << i << ";\n";
+		}
 	}
+	return builder.str();
+}
+
+string WireInfo::makeDeclaration() {
+	string onedim_base = makeOnedimBase();
 
 	if (getNumDimensions() > 1) {
 		ostringstream builder;
@@ -750,20 +3117,29 @@ string WireInfo::makeDeclaration() {
 	}
 }
 
-std::pair<size_t,size_t> parseVectorDeclation(const string& decl) {
-	pair<size_t,size_t> result;
-
-	istringstream second_dim_decl(
-		trim(decl)
-	);
-
-	result.first = mathEval(readUntil(second_dim_decl, ":", true));
-	second_dim_decl.get(); // consume ':'
-	result.second = mathEval(second_dim_decl);
-	return result;
+/**
+ * Evaluates the bounds in a `msb:lsb' style declaration. Returns false if there
+ * isn't a ':', or either side isn't a non-negative constant.
+ */
+bool parseVectorDeclation(const string& decl, ConstantEvaluator& constants, std::pair<size_t,size_t>& result) {
+	size_t colon_pos = decl.find(':');
+	if (colon_pos == string::npos) {
+		return false;
+	}
+	long first = 0;
+	long second = 0;
+	if (
+		!constants.evaluate(decl.substr(0, colon_pos), first)
+		|| !constants.evaluate(decl.substr(colon_pos + 1), second)
+		|| first < 0 || second < 0
+	) {
+		return false;
+	}
+	result = make_pair(static_cast<size_t>(first), static_cast<size_t>(second));
+	return true;
 }
 
-std::pair<bool,WireInfo> WireInfo::parseWire(string& decl) {
+std::pair<bool,WireInfo> WireInfo::parseWire(string& decl, ConstantEvaluator& constants) {
 	// cerr << "parsing wire/reg: `" << decl << "'\n";
 
 	bool success = false;
@@ -809,13 +3185,13 @@ std::pair<bool,WireInfo> WireInfo::parseWire(string& decl) {
 				bracket_location + 1,
 				decl.find_first_of("]",bracket_location) - (bracket_location + 1)
 			);
-			try {
-				std::pair<size_t,size_t> dim_pair = parseVectorDeclation(dim_decl);
+			std::pair<size_t,size_t> dim_pair;
+			if (parseVectorDeclation(dim_decl, constants, dim_pair)) {
 				if (dim_pair.first > dim_pair.second) {
 					std::swap(dim_pair.first, dim_pair.second);
 				}
 				wire_info.dimension_sizes.push_back(dim_pair);
-			} catch (std::invalid_argument& e) {
+			} else {
 				wire_info.use_custom_firstdim_decl = true;
 				wire_info.custom_firstdim_decl = dim_decl;
 			}
@@ -861,8 +3237,8 @@ vector<string> parseParamList(istream& is) {
 	char first_char;
 	is >> first_char;
 	if (first_char != '(') {
-		cerr << "param list doesn't start with a '(' ( is '"<<first_char<<"')\n";
-		exit(1);
+		throw PreprocessorError(
+			"param list doesn't start with a '(' ( is '" + string(1,first_char) + "')");
 	}
 
 	string param_list = readUntil(is,")",true);
@@ -914,6 +3290,75 @@ vector<string> splitAndTrim(const string& s, char delim) {
 	return result;
 }
 
+string directoryOf(const string& path) {
+	string::size_type last_slash = path.find_last_of('/');
+	if (last_slash == string::npos) {
+		return ".";
+	} else if (last_slash == 0) {
+		return "/";
+	}
+	return path.substr(0, last_slash);
+}
+
+string canonicalPath(const string& path) {
+	char* real_path = realpath(path.c_str(), nullptr);
+	if (!real_path) {
+		return path;
+	}
+	string result(real_path);
+	free(real_path);
+	return result;
+}
+
+bool isRegularFile(const string& path) {
+	struct stat file_stat;
+	return stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+}
+
+/**
+ * Makes to a copy of from, with the given mode (less the umask). It shares from's
+ * blocks where the file system can do that copy-on-write, but it's never the same
+ * file, so writing to one can't change the other.
+ */
+bool cloneOrCopyFile(const string& from, const string& to, mode_t mode) {
+	int from_fd = open(from.c_str(), O_RDONLY);
+	if (from_fd == -1) {
+		return false;
+	}
+	unlink(to.c_str());
+	int to_fd = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, mode);
+	if (to_fd == -1) {
+		close(from_fd);
+		return false;
+	}
+
+	bool copied = false;
+#ifdef FICLONE
+	copied = ioctl(to_fd, FICLONE, from_fd) == 0;
+#endif
+	if (!copied) {
+		char buffer[64 * 1024];
+		ssize_t num_read = 0;
+		copied = true;
+		while (copied && (num_read = read(from_fd, buffer, sizeof(buffer))) != 0) {
+			if (num_read == -1) {
+				copied = errno == EINTR;
+				continue;
+			}
+			for (ssize_t num_written = 0; copied && num_written < num_read; ) {
+				ssize_t written = write(to_fd, buffer + num_written, num_read - num_written);
+				if (written == -1) {
+					copied = errno == EINTR;
+				} else {
+					num_written += written;
+				}
+			}
+		}
+	}
+	close(from_fd);
+	return close(to_fd) == 0 && copied;
+}
+
 string& trim(string& str) {
 	str.erase(str.find_last_not_of(" \n\r\t") + 1, string::npos);
 	str.erase(0, str.find_first_not_of(" \n\r\t"));
@@ -925,30 +3370,137 @@ string trim(const string& str) {
 	return trim(result);
 }
 
-string skipToNextLineIfComment(char prev_char, char c, istream& is) {
+/**
+ * If c (just after prev_char) starts a comment or a string literal, reads the rest of
+ * it into rest and returns true. Line comments stop before the newline, and block
+ * comments and strings include their closing delimiter. Macro expansion and
+ * lexTokens both go through here, so that they agree on what isn't code.
+ */
+bool readCommentOrString(int prev_char, int c, istream& is, string& rest) {
+	rest.clear();
 	if (prev_char == '/' && c == '/') {
-		return readUntil(is,"\n",false);
+		rest = readUntil(is,"\n",false);
+		return true;
+	} else if (prev_char == '/' && c == '*') {
+		int prev_in_comment = '\0';
+		while (true) {
+			int next = is.get();
+			if (is.eof()) {
+				break;
+			}
+			rest += next;
+			if (prev_in_comment == '*' && next == '/') {
+				break;
+			}
+			prev_in_comment = next;
+		}
+		return true;
+	} else if (c == '"') {
+		while (true) {
+			int next = is.peek();
+			if (next == EOF || next == '\n') {
+				break; // unterminated
+			}
+			rest += is.get();
+			if (next == '\\') {
+				if (is.peek() != EOF && is.peek() != '\n') {
+					rest += is.get();
+				}
+			} else if (next == '"') {
+				break;
+			}
+		}
+		return true;
 	}
-	return "";
+	return false;
 }
 
-std::pair<size_t,size_t> parseRange(const vector<string>& params, size_t index1, size_t index2) {
-	std::pair<size_t,size_t> range;
-	try {
-		range.first = mathEval(params[index1]);
-		range.second = mathEval(params[index2]);
-	} catch (const std::invalid_argument& e) {
-		cerr
-			<< "bad GENDEFINE param "<<(index1+1)<<" or "<<(index2+1)<<": '" << params[index1]
-			<< "'' or '" << params[index2] << "'\n";
-		exit(1);
-	} catch (const std::out_of_range& e) {
-		cerr
-			<< "bad GENDEFINE param "<<(index1+1)<<" or "<<(index2+1)<<" (out of range): '" << params[index1]
-			<< "'' or '" << params[index2] << "'\n";
-		exit(1);
-	}
-	return range;
+/**
+ * Splits text into tokens, leaving comments and strings to readCommentOrString.
+ * Unless at_end, the last token might carry on in whatever comes next, so it's left
+ * out. Returns how much of text the tokens cover.
+ */
+template<typename Emit>
+size_t lexTokens(const char* text, size_t size, bool at_end, Emit emit) {
+	// only made if there's a comment or a string, since most of what's lexed is short
+	unique_ptr<MemoryInBuf> text_buf;
+	unique_ptr<istream> text_stream;
+	string rest;
+	size_t pos = 0;
+	Token last = Token{text, 0, TokenKind::PUNCT, no_symbol}; // not emitted yet
+	while (pos < size) {
+		size_t start = pos;
+		unsigned char c = text[pos++];
+		TokenKind kind = TokenKind::PUNCT;
+		if (isIdentifierChar(c)) {
+			kind = TokenKind::WORD;
+			while (pos < size && isIdentifierChar(static_cast<unsigned char>(text[pos]))) {
+				++pos;
+			}
+		} else if (isspace(c)) {
+			kind = TokenKind::SPACE;
+			while (pos < size && isspace(static_cast<unsigned char>(text[pos]))) {
+				++pos;
+			}
+		} else if (c == '"' || (c == '/' && pos < size && (text[pos] == '/' || text[pos] == '*'))) {
+			kind = c == '"' ? TokenKind::STRING : TokenKind::COMMENT;
+			int prev_char = '\0';
+			int first = c;
+			if (c == '/') {
+				prev_char = c;
+				first = static_cast<unsigned char>(text[pos++]);
+			}
+			if (!text_stream) {
+				text_buf.reset(new MemoryInBuf(text, size));
+				text_stream.reset(new istream(text_buf.get()));
+			}
+			text_buf->seek(pos);
+			text_stream->clear();
+			readCommentOrString(prev_char, first, *text_stream, rest);
+			pos = text_buf->tell();
+		}
+		if (last.size != 0) {
+			emit(last);
+		}
+		Symbol symbol = kind == TokenKind::WORD ? findKeyword(text + start, pos - start) : no_symbol;
+		last = Token{text + start, pos - start, kind, symbol};
+	}
+	if (!at_end) {
+		return last.text - text;
+	}
+	if (last.size != 0) {
+		emit(last);
+	}
+	return pos;
+}
+
+/// the text of the tokens up to (and not including) the next c, or the end
+string readTokensUntil(TokenReader& in, char c) {
+	string text;
+	while (in.peek() && !in.peek()->is(c)) {
+		const Token& token = in.get();
+		text.append(token.text, token.size);
+	}
+	return text;
+}
+
+std::pair<size_t,size_t> parseRange(
+	const vector<string>& params, size_t index1, size_t index2, ConstantEvaluator& constants
+) {
+	long first = 0;
+	long second = 0;
+	if (
+		!constants.evaluate(params[index1], first)
+		|| !constants.evaluate(params[index2], second)
+		|| first < 0 || second < 0
+	) {
+		ostringstream message;
+		message
+			<< "bad GENDEFINE param "<<(index1+1)<<" or "<<(index2+1)<<" (not a constant): '" << params[index1]
+			<< "'' or '" << params[index2] << "'";
+		throw PreprocessorError(message.str());
+	}
+	return make_pair(static_cast<size_t>(first), static_cast<size_t>(second));
 }
 
 string parseAssignmentOp(const vector<string>& params, size_t index) {
@@ -957,31 +3509,14 @@ string parseAssignmentOp(const vector<string>& params, size_t index) {
 	} else if (params[index] == "blocking") {
 		return "=";
 	} else {
-		cerr
+		ostringstream message;
+		message
 			<< "bad GENDEFINE param #"<<(index+1)<<": `"<<params[index]
-			<<"' did you mean blocking or nonblocking?\n";
-		exit(1);
-		return "";
+			<<"' did you mean blocking or nonblocking?";
+		throw PreprocessorError(message.str());
 	}
 }
 
-enum class GendefineType : size_t {
-	NONE = 0,
-	CHOOSE_TO,
-	CHOOSE_FROM,
-	ALWAYS_LIST,
-	MOD_OP,
-};
-
-namespace std {
-	template<>
-	struct hash<GendefineType> {
-		size_t operator()(const GendefineType& gt) const {
-			return std::hash<size_t>()(static_cast<size_t>(gt));
-		}
-	};
-}
-
 const std::unordered_map<GendefineType,size_t> gendefine_argnums {
 	{GendefineType::CHOOSE_TO,     3},
 	{GendefineType::CHOOSE_FROM,   3},
@@ -996,227 +3531,427 @@ const std::unordered_map<string,GendefineType> string2gendefine {
 	{"mod_op",        GendefineType::MOD_OP       },
 };
 
-string generate_define(const string& params_string) {
+Macro generate_define(const string& params_string, ConstantEvaluator& constants) {
 	vector<string> params = parseParamList(params_string);
 
 	GendefineType this_gendefine_type = GendefineType::NONE;
 	{
 		auto found_gendefine_type = string2gendefine.find(params[0]);
 		if (found_gendefine_type == string2gendefine.end()) {
-			cerr << "bad GENDEFINE type in : `" << params_string << "'\n";
-			exit(1);
+			throw PreprocessorError("bad GENDEFINE type in : `" + params_string + "'");
 		} else {
 			this_gendefine_type = found_gendefine_type->second;
 		}
 	}
 
 	if (params.size() != (gendefine_argnums.find(this_gendefine_type)->second + 1)) {
-		cerr<<"bad number of arguments to GENDEFINE: `" << params_string << "'\n";
-		exit(1);
+		throw PreprocessorError("bad number of arguments to GENDEFINE: `" + params_string + "'");
 	}
 
-	ostringstream builder;
-
 	// make the name
-	builder << params[0];
+	string name = params[0];
 	for (size_t i = 1; i < params.size(); ++i) {
-		builder << '_' << params[i];
+		name += '_' + params[i];
 	}
 
+	GendefineSpec spec{this_gendefine_type, "", 0, 0, 1};
+	vector<string> macro_params;
+
 	switch (this_gendefine_type) {
 		case GendefineType::CHOOSE_TO:
 		case GendefineType::CHOOSE_FROM: {
-			std::pair<size_t,size_t> range = parseRange(params,2,3);
-			string assignment_op = parseAssignmentOp(params,1);
-
-			string assign_to;
-			string assign_from;
-			bool assign_to_is_indexed = false;
-			bool assign_from_is_indexed = false;
+			std::tie(spec.range_first, spec.range_last) = parseRange(params,2,3,constants);
+			spec.assignment_op = parseAssignmentOp(params,1);
 			if (this_gendefine_type == GendefineType::CHOOSE_TO) {
-				builder
-					<< "(index_expr, assign_to, expression) \\\n\tcase (index_expr) \\\n"
-				;
-				assign_to = "assign_to";
-				assign_to_is_indexed = true;
-				assign_from = "expression";
-				assign_from_is_indexed = false;
-			} else if (this_gendefine_type == GendefineType::CHOOSE_FROM) {
-				builder
-					<< "(index_expr, assign_to, assign_from) \\\n\tcase (index_expr) \\\n"
-				;
-				assign_to = "assign_to";
-				assign_to_is_indexed = false;
-				assign_from = "assign_from";
-				assign_from_is_indexed = true;
+				macro_params = {"index_expr", "assign_to", "expression"};
+			} else {
+				macro_params = {"index_expr", "assign_to", "assign_from"};
+			}
+		} break;
+		case GendefineType::ALWAYS_LIST: {
+			std::tie(spec.range_first, spec.range_last) = parseRange(params,1,2,constants);
+			macro_params = {"wire_name"};
+		} break;
+		case GendefineType::MOD_OP: {
+			spec.assignment_op = parseAssignmentOp(params,1);
+			std::tie(spec.range_first, spec.range_last) = parseRange(params,3,4,constants);
+			long mod_by = 0;
+			if (!constants.evaluate(params[2], mod_by)) {
+				throw PreprocessorError("bad GENDEFINE param #2 in `" + params_string + "'");
+			}
+			if (mod_by <= 0) {
+				throw PreprocessorError("bad GENDEFINE param #2 (must be positive) in `" + params_string + "'");
 			}
+			spec.mod_by = static_cast<size_t>(mod_by);
+			macro_params = {"input", "output"};
+		} break;
+		case GendefineType::NONE:
+		break;
+	}
+
+	return Macro(name, macro_params, spec);
+}
 
-			for (size_t i = range.first; i <= range.second; ++i) {
-				if (i == range.second) {
-					builder << "\t\tdefault";
+/**
+ * Writes out the expansion, exactly as it would have come out had it been
+ * written as a `define with a line per case arm.
+ */
+void GendefineSpec::write(const vector<string>& args, ostream& os) const {
+	switch (type) {
+		case GendefineType::CHOOSE_TO:
+		case GendefineType::CHOOSE_FROM: {
+			bool assign_to_is_indexed = (type == GendefineType::CHOOSE_TO);
+			bool assign_from_is_indexed = (type == GendefineType::CHOOSE_FROM);
+			os << "case (" << args[0] << ") \n";
+			for (size_t i = range_first; i <= range_last; ++i) {
+				if (i == range_last) {
+					os << "\t\tdefault";
 				} else {
-					builder << "\t\t'd" << i;
+					os << "\t\t'd" << i;
 				}
-				builder << ':' << assign_to;
+				os << ':' << args[1];
 				if (assign_to_is_indexed) {
-					builder << '[' << i << ']';
+					os << '[' << i << ']';
 				}
-				builder << ' ' << assignment_op << ' ' << assign_from;
+				os << ' ' << assignment_op << ' ' << args[2];
 				if (assign_from_is_indexed) {
-					builder << '[' << i << ']';
+					os << '[' << i << ']';
 				}
-				builder << "; \\\n";
+				os << "; \n";
 			}
-
-			builder << "\tendcase";
+			os << "\tendcase";
 		} break;
 		case GendefineType::ALWAYS_LIST: {
-			std::pair<size_t,size_t> range = parseRange(params,1,2);
-			builder << "(wire_name) \\\n";
-			for (size_t i = range.first; i <= range.second; ++i) {
-				builder << "wire_name[" << i << "]";
-				if (i != range.second) {
-					builder << " or ";
+			for (size_t i = range_first; i <= range_last; ++i) {
+				os << args[0] << '[' << i << ']';
+				if (i != range_last) {
+					os << " or ";
 				}
 			}
 		} break;
 		case GendefineType::MOD_OP: {
-			string assignment_op = parseAssignmentOp(params,1);
-			auto range = parseRange(params,3,4);
-			size_t mod_by = 1;
-			try {
-				mod_by = stoi(params[2]);
-			} catch (const std::invalid_argument& e) {
-				cerr << "bad GENDEFINE param #2 in `" << params_string << "'\n";
-				exit(1);
-			} catch (const std::out_of_range& e) {
-				cerr << "bad GENDEFINE param #2 (out of range) in `" << params_string << "'\n";
-				exit(1);
+			os << "case (" << args[0] << ") \n";
+			for (size_t i = range_first; i <= range_last; ++i) {
+				os << "\t\t'd" << i << ": " << args[1] << ' ' << assignment_op << ' ' << (i % mod_by) << "; \n";
 			}
-			builder << "(input, output) \\\n\tcase (input) \\\n";
-			for (size_t i = range.first; i <= range.second; ++i) {
-				builder
-					<< "\t\t'd" << i << ": output " << assignment_op << ' ' << (i % mod_by) << "; \\\n"
-				;
-			}
-			builder << "\tendcase";
+			os << "\tendcase";
 		} break;
 		case GendefineType::NONE:
 		break;
 	}
+}
+
+const size_t max_memoized_constants = 64 * 1024;
+
+ConstantEvaluator::ConstantEvaluator(Caret caret_)
+	: caret(caret_)
+	, symbols()
+	, memo()
+	, tokens()
+	, next_token(0) {
+
+}
+
+bool ConstantEvaluator::evaluate(const string& expr, long& result) {
+	auto memoized = memo.find(expr);
+	if (memoized != memo.end()) {
+		if (memoized->second.first) {
+			result = memoized->second.second;
+		}
+		return memoized->second.first;
+	}
 
-	return builder.str();
+	long value = 0;
+	next_token = 0;
+	bool is_constant =
+		tokenize(expr)
+		&& !tokens.empty()
+		&& parseExpression(1, value)
+		&& next_token == tokens.size();
+
+	if (memo.size() >= max_memoized_constants) {
+		memo.clear();
+	}
+	memo.insert(make_pair(expr, make_pair(is_constant, value)));
+
+	if (is_constant) {
+		result = value;
+	}
+	return is_constant;
 }
 
-/// algorithm from http://en.wikipedia.org/wiki/Operator-precedence_parser
-// expression ::= primary OPERATOR primary
-// primary ::= '(' expression ')' | NUMBER | VARIABLE
+void ConstantEvaluator::defineSymbol(const string& name, long value) {
+	symbols[name] = value;
+	// some of what wasn't constant before might be now
+	memo.clear();
+}
 
-unordered_map<char,int> precedence_map = {
-	{ '+' , 1 },
-	{ '-' , 1 },
-	{ '*' , 2 },
-	{ '/' , 2 },
-	{ '%' , 2 },
-	{ '^' , 3 },
-};
+void ConstantEvaluator::defineParameters(const string& decl) {
+	// split into `[type] name = expression' assignments, on the top level commas
+	vector<string> assignments(1);
+	int depth = 0;
+	for (char c : decl) {
+		if (c == '(' || c == '[' || c == '{') {
+			++depth;
+		} else if (c == ')' || c == ']' || c == '}') {
+			--depth;
+		} else if (c == ',' && depth == 0) {
+			assignments.emplace_back();
+			continue;
+		}
+		assignments.back() += c;
+	}
 
-long expression(istream& is, long lhs, long min_precedence);
-long parse_primary(istream& is);
-long do_binary_op(long lhs, long rhs, char op);
+	for (const string& assignment : assignments) {
+		size_t equals_pos = assignment.find('=');
+		if (equals_pos == string::npos) {
+			continue;
+		}
+		// the name is the last thing before the '=', after any type
+		string lhs = trim(assignment.substr(0, equals_pos));
+		size_t name_start = lhs.size();
+		while (name_start > 0 && isIdentifierChar(lhs[name_start - 1])) {
+			--name_start;
+		}
+		string name = lhs.substr(name_start);
+		long value = 0;
+		if (!name.empty() && evaluate(assignment.substr(equals_pos + 1), value)) {
+			defineSymbol(name, value);
+		}
+	}
+}
+
+void ConstantEvaluator::clearSymbols() {
+	symbols.clear();
+	memo.clear();
+}
 
-long mathEval(istream& expr) {
-	return expression(expr, parse_primary(expr), 0);
+bool ConstantEvaluator::tokenize(const string& expr) {
+	tokens.clear();
+	size_t pos = 0;
+	while (pos < expr.size()) {
+		char c = expr[pos];
+		if (isspace(static_cast<unsigned char>(c))) {
+			++pos;
+		} else if (isdigit(static_cast<unsigned char>(c)) || c == '\'') {
+			long value = 0;
+			if (!parseNumber(expr, pos, value)) {
+				return false;
+			}
+			tokens.push_back(Token{'n', value});
+		} else if (isIdentifierChar(c) || c == '`') {
+			if (c == '`') {
+				++pos; // a macro that's a constant is a symbol too
+			}
+			size_t name_start = pos;
+			while (pos < expr.size() && isIdentifierChar(expr[pos])) {
+				++pos;
+			}
+			auto symbol = symbols.find(expr.substr(name_start, pos - name_start));
+			if (symbol == symbols.end()) {
+				return false;
+			}
+			tokens.push_back(Token{'n', symbol->second});
+		} else if (c == '*' && pos + 1 < expr.size() && expr[pos + 1] == '*') {
+			tokens.push_back(Token{'p', 0});
+			pos += 2;
+		} else if (c == '^' && caret == Caret::POWER) {
+			tokens.push_back(Token{'p', 0});
+			++pos;
+		} else if (strchr("+-*/%^()", c) != NULL) {
+			tokens.push_back(Token{c, 0});
+			++pos;
+		} else {
+			return false;
+		}
+	}
+	return true;
 }
 
 /**
- * Parse out a primary expression, something that is self-contained, and
- * has a value; a number, a parentheses enclosed expression, or a
- * constant (though the last one in currently unsupported)
+ * Reads a number like 12, 1_000, 'hff or 8'd3. Anything with x or z digits
+ * isn't a constant, as far as this is concerned.
  */
-long parse_primary(istream& is) {
-	// read until you've found something that definite ends,
-	// or starts, (in the case of ')' ) a primary expression
-	string primary = trim(readUntil(is, "+-*/%(^ ",true));
-	long result = 0;
-	if (is.peek() == '(') {
-		if (primary.size() != 0) {
-			cerr << "Bad primary. Unexpected `" <<primary<< "' in `" <<primary<<readUntil(is,"\n",false)<< "'\n";
-			exit(1);
-		}
-		is.get(); // consume '('
-		string subexpr = readUntil(is, ")", true);
-		if (is.eof()) {cerr << "no matching ')'\n"; exit(1);}
-		is.get(); // consume ')'m
-		stringstream subexprss(trim(subexpr));
-		result = expression(subexprss, parse_primary(subexprss), 0);
-	} else {
-		try {
-			// TODO: parse variable names here
-			result = stol(primary);
-		} catch (const std::invalid_argument& e) {
-			cerr << "bad long: " << primary << "\n"; throw e;
-		} catch (const std::out_of_range& e) {
-			cerr << "long out of range: " << primary << "\n"; throw e;
+bool ConstantEvaluator::parseNumber(const string& expr, size_t& pos, long& value) {
+	auto read_digits = [&](int base, long& digits_value) {
+		size_t digits_start = pos;
+		digits_value = 0;
+		while (pos < expr.size() && (isalnum(static_cast<unsigned char>(expr[pos])) || expr[pos] == '_')) {
+			char c = static_cast<char>(tolower(static_cast<unsigned char>(expr[pos])));
+			++pos;
+			if (c == '_') {
+				continue;
+			}
+			int digit = isdigit(static_cast<unsigned char>(c)) ? (c - '0') : (c >= 'a' && c <= 'f') ? (c - 'a' + 10) : base;
+			if (digit >= base || digits_value > (std::numeric_limits<long>::max() - digit) / base) {
+				return false;
+			}
+			digits_value = digits_value * base + digit;
+		}
+		return pos != digits_start;
+	};
+
+	if (expr[pos] != '\'') {
+		if (!read_digits(10, value)) {
+			return false;
+		}
+		if (pos == expr.size() || expr[pos] != '\'') {
+			return true;
 		}
+		// that was the size
 	}
-	return result;
+
+	++pos; // consume '\''
+	if (pos < expr.size() && (expr[pos] == 's' || expr[pos] == 'S')) {
+		++pos;
+	}
+	if (pos == expr.size()) {
+		return false;
+	}
+	int base = 0;
+	switch (tolower(static_cast<unsigned char>(expr[pos]))) {
+		case 'd': base = 10; break;
+		case 'h': base = 16; break;
+		case 'o': base = 8;  break;
+		case 'b': base = 2;  break;
+		default: return false;
+	}
+	++pos;
+	return read_digits(base, value);
 }
 
-// from http://en.wikipedia.org/wiki/Operator-precedence_parser
-// parse_expression (lhs, min_precedence)
-//     while the next token is a binary operator whose precedence is >= min_precedence
-//         op := next token
-//         rhs := parse_primary ()
-//         while the next token is a binary operator whose precedence is greater
-//                  than op's, or a right-associative operator
-//                  whose precedence is equal to op's
-//             lookahead := next token
-//             rhs := parse_expression (rhs, lookahead's precedence)
-//         lhs := the result of applying op with operands lhs and rhs
-//     return lhs
-
-long expression(istream& is, long lhs, long min_precedence) {
-	while (true) {
-		char this_op;
-		if (!(is >> this_op)) {
+/// Verilog's, where ^ (xor) binds the loosest and ** the tightest
+int precedenceOf(char op) {
+	switch (op) {
+		case '^':                     return 1;
+		case '+': case '-':           return 2;
+		case '*': case '/': case '%': return 3;
+		case 'p':                     return 4;
+		default:                      return 0; // not a binary operator
+	}
+}
+
+/// returns false if the result isn't defined, or doesn't fit in a long
+bool applyBinaryOp(char op, long lhs, long rhs, long& result) {
+	switch (op) {
+		case '^': result = lhs ^ rhs; return true;
+		case '+': return !__builtin_add_overflow(lhs, rhs, &result);
+		case '-': return !__builtin_sub_overflow(lhs, rhs, &result);
+		case '*': return !__builtin_mul_overflow(lhs, rhs, &result);
+		case '/': case '%':
+			if (rhs == 0 || (rhs == -1 && lhs == std::numeric_limits<long>::min())) {
+				return false;
+			}
+			result = (op == '/') ? lhs / rhs : lhs % rhs;
+			return true;
+		case 'p': {
+			if (rhs < 0) {
+				return false;
+			}
+			long power = 1;
+			long base = lhs;
+			while (rhs != 0) {
+				if (rhs % 2 == 1 && __builtin_mul_overflow(power, base, &power)) {
+					return false;
+				}
+				rhs /= 2;
+				if (rhs != 0 && __builtin_mul_overflow(base, base, &base)) {
+					return false;
+				}
+			}
+			result = power;
+		} return true;
+		default: return false;
+	}
+}
+
+/// precedence climbing; ** is right-associative, the rest are left
+bool ConstantEvaluator::parseExpression(int min_precedence, long& result) {
+	long lhs = 0;
+	if (!parsePrimary(lhs)) {
+		return false;
+	}
+	while (next_token < tokens.size()) {
+		char op = tokens[next_token].kind;
+		int precedence = precedenceOf(op);
+		if (precedence == 0 || precedence < min_precedence) {
 			break;
 		}
-		long this_op_precedence = precedence_map.find(this_op)->second;
-		if (this_op_precedence < min_precedence) {
-			is.putback(this_op);
-			return lhs;
+		++next_token;
+		long rhs = 0;
+		if (
+			!parseExpression(op == 'p' ? precedence : precedence + 1, rhs)
+			|| !applyBinaryOp(op, lhs, rhs, lhs)
+		) {
+			return false;
 		}
-		long rhs = parse_primary(is);
-		while (true) {
-			char next_op = 0;
-			if (!(is >> next_op)) {
-				break;
-			}
-			// TODO: support right-associative operators (eg. unary ones)
-			long next_op_precedence = precedence_map.find(next_op)->second;
-			is.putback(next_op);
-			if (next_op_precedence <= this_op_precedence) {
-				break;
+	}
+	result = lhs;
+	return true;
+}
+
+/// a number, a parenthesised expression, or a unary +/- of one
+bool ConstantEvaluator::parsePrimary(long& result) {
+	if (next_token == tokens.size()) {
+		return false;
+	}
+	const Token& token = tokens[next_token++];
+	switch (token.kind) {
+		case 'n':
+			result = token.value;
+			return true;
+		case '(':
+			if (!parseExpression(1, result) || next_token == tokens.size() || tokens[next_token].kind != ')') {
+				return false;
 			}
-			rhs = expression(is, rhs, next_op_precedence);
-		}
-		lhs = do_binary_op(lhs, rhs, this_op);
+			++next_token; // consume ')'
+			return true;
+		case '-':
+			return parsePrimary(result) && !__builtin_sub_overflow(0L, result, &result);
+		case '+':
+			return parsePrimary(result);
+		default:
+			return false;
 	}
-	return lhs;
 }
 
-long do_binary_op(long lhs, long rhs, char op) {
-	switch (op) {
-		case '*': return lhs * rhs;
-		case '/': return lhs / rhs;
-		case '+': return lhs + rhs;
-		case '-': return lhs - rhs;
-		case '%': return lhs % rhs;
-		case '^': return lround(pow(lhs,rhs));
-		default :
-			cerr << "bad operator : '" << op << "'\n";
-			exit(1);
-			return 0;
+
+/**
+ * Call with in just after a `parameter' or `localparam'. Copies the rest of the
+ * declaration (up to the ';', or the ')' that ends a module's parameter list) to
+ * out, and if it's a localparam, defines its values in constants. Returns the last
+ * character copied.
+ */
+int copyParameterDecl(TokenReader& in, TokenWriter& out, bool is_localparam, ConstantEvaluator& constants) {
+	string code; // without the comments
+	int prev_char = ' ';
+	int depth = 0;
+	while (true) {
+		const Token* next = in.peek();
+		if (!next || next->is(';') || (next->is(')') && depth == 0)) {
+			break;
+		}
+		const Token& token = in.get();
+		out.put(token);
+		prev_char = token.lastChar(prev_char);
+
+		if (token.kind == TokenKind::COMMENT) {
+			code += ' ';
+			continue;
+		} else if (token.kind == TokenKind::STRING) {
+			code += "\"\"";
+			continue;
+		}
+
+		if (token.is('(') || token.is('[') || token.is('{')) {
+			++depth;
+		} else if (token.is(')') || token.is(']') || token.is('}')) {
+			--depth;
+		}
+		code.append(token.text, token.size);
+	}
+	if (is_localparam) {
+		constants.defineParameters(code);
 	}
+	return prev_char;
 }